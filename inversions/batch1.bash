@@ -0,0 +1,33 @@
+#!/usr/bin/env bash
+
+# Model definition, A is shared by all datasets
+input_A=A.txt
+
+# Batch file, every line holds a B file, a C file and an output samples file, e.g.
+#   event1/B.txt event1/C.txt event1/samples.txt
+name=batch1
+batch_file=${name}/datasets.txt
+output_log=${name}/${name}.log
+
+# Tuning parameters
+mass_matrix_type=0 # 0 for complete, 1 for diagonal, 2 for unit
+temperature=1
+adapt_time_step=1
+time_step=nan # nan for default, is overridden by adapttmestep
+number_of_samples=$((100000))
+
+# Run inversions
+./hmc_sampler \
+    -nt 25 \
+    -ia ${input_A} \
+    -bf ${batch_file} \
+    -ns ${number_of_samples} \
+    -t ${temperature} \
+    -dt ${time_step} \
+    -at ${adapt_time_step} \
+    --massmatrixtype ${mass_matrix_type} \
+    2>&1 | tee ${output_log}
+
+sed -i 's/\x1b\[[0-9;]*m//g' ${output_log}
+# Remove progress bars only, the per-dataset results also start with [i/N]
+sed -i '/^\[ *[0-9]*%\]/d' ${output_log}
@@ -0,0 +1,38 @@
+#!/usr/bin/env bash
+
+# Model definition, A is a convolution operator written by the quadratic executable, e.g.
+#   ./quadratic kernel.txt data.txt m0.txt 1.0 0.01 convolution
+input_A_kernel=A_kernel.txt
+input_B=B.txt
+input_C=C.txt
+
+# Output files
+name=deconvolution1
+output_samples=${name}/samples.txt
+output_trajectory=${name}/trajectory.txt
+output_log=${name}/${name}.log
+
+# Tuning parameters
+mass_matrix_type=1 # 1 for diagonal, 2 for unit, 3 for low rank plus diagonal (complete is not available)
+temperature=1
+adapt_time_step=1
+time_step=nan # nan for default, is overridden by adapttmestep
+number_of_samples=$((10000))
+
+# Run inversion
+./hmc_sampler \
+    -nt 25 \
+    -iak ${input_A_kernel} \
+    -ib ${input_B} \
+    -ic ${input_C} \
+    -os ${output_samples} \
+    -ot ${output_trajectory} \
+    -ns ${number_of_samples} \
+    -t ${temperature} \
+    -dt ${time_step} \
+    -at ${adapt_time_step} \
+    --massmatrixtype ${mass_matrix_type} \
+    2>&1 | tee ${output_log}
+
+sed -i 's/\x1b\[[0-9;]*m//g' ${output_log}
+sed -i '/\[/d' ${output_log}
@@ -0,0 +1,317 @@
+/*
+ * Accuracy versus cost of sampler configurations, measured against the analytic Gaussian posterior.
+ *
+ * For every generated problem and sampler configuration seeded chains are run, after which the error of the running
+ * mean and covariance of the samples is written as a function of the number of gradient evaluations and wall time. The
+ * cost (gradient evaluations, median over the seeds) needed to reach fixed errors is compared to a recorded baseline.
+ *
+ * Usage: accuracy_harness <output folder> <baseline file> [record]
+ * Without a baseline file, or with 'record', the baseline is (re)written instead of compared against, which fails if a
+ * configuration does not reach the target errors. A baseline file that exists but cannot be read is an error. Before sampling, the FFT convolution operator (-iak) is checked against
+ * dense matrices.
+ */
+
+#include <cstdlib>
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <armadillo>
+#include "../hmc/linearSampler.hpp"
+#include "../hmc/convolutionOperator.hpp"
+
+// Errors at which the cost of a configuration is measured
+const double meanErrorTarget = 0.2; // Root mean square error of the mean, in posterior standard deviations
+const double covarianceErrorTarget = 0.3; // Frobenius norm of the covariance error, relative to the posterior
+// Factor by which a cost may exceed its baseline, changes to the sampler also change its random streams
+const double costTolerance = 2.0;
+const unsigned long proposals = 10000;
+const unsigned long checkpoints = 50;
+const std::vector<unsigned int> seeds = {1, 2, 3};
+
+struct problem {
+    std::string name;
+    arma::vec m0;
+    arma::vec m_post;
+    arma::mat cm_post;
+    std::vector<std::string> excluded; ///< Configurations that cannot reach the targets within the proposals.
+};
+
+struct configuration {
+    std::string name;
+    std::vector<std::string> options;
+};
+
+// Quadratic form of a random linear problem as in createQuadraticForm, with the columns of G scaled by scales
+problem create_problem(const std::string &folder, const std::string &name, const arma::vec &scales, int seed) {
+    arma::arma_rng::set_seed(seed);
+    const double m_var = 1.0;
+    const double d_var = 0.01;
+
+    arma::mat G = arma::randn(2 * scales.n_elem, scales.n_elem) * arma::diagmat(scales);
+    arma::vec m0 = arma::zeros(scales.n_elem);
+    arma::vec d0 = G * arma::randn(scales.n_elem) + sqrt(d_var) * arma::randn(G.n_rows);
+
+    arma::mat A = 0.5 * (arma::eye(G.n_cols, G.n_cols) / m_var + G.t() * G / d_var);
+    arma::colvec B = -(m0 / m_var + G.t() * d0 / d_var);
+    arma::mat C = 0.5 * (dot(m0, m0) / m_var + dot(d0, d0) / d_var) * arma::ones(1, 1);
+
+    A.save(folder + "/" + name + "_A.txt", arma::raw_ascii);
+    B.save(folder + "/" + name + "_B.txt", arma::raw_ascii);
+    C.save(folder + "/" + name + "_C.txt", arma::raw_ascii);
+
+    problem generated;
+    generated.name = name;
+    generated.m0 = m0;
+    generated.cm_post = arma::inv_sympd(2 * A);
+    generated.m_post = -generated.cm_post * B;
+    return generated;
+}
+
+// First cost after which the error stays below the target, infinite if it is not reached
+double cost_to_reach(const arma::vec &cost, const arma::vec &error, double target) {
+    double reached = arma::datum::inf;
+    for (arma::uword i = error.n_elem; i-- > 0 && error[i] <= target;) {
+        reached = cost[i];
+    }
+    return reached;
+}
+
+// Median of an odd number of costs, unreached targets (infinite cost) sort last
+double median(std::vector<double> costs) {
+    std::sort(costs.begin(), costs.end());
+    return costs[costs.size() / 2];
+}
+
+// Run one seeded chain of a configuration on one problem, write the error curve and return the cost to reach the
+// target errors
+std::pair<double, double> run_configuration(const std::string &folder, const problem &posterior,
+                                            const configuration &config, unsigned int seed) {
+    std::string prefix = folder + "/" + posterior.name + "_" + config.name + "_seed" + std::to_string(seed);
+    std::vector<std::string> args = {"accuracy_harness",
+                                     "-ia", folder + "/" + posterior.name + "_A.txt",
+                                     "-ib", folder + "/" + posterior.name + "_B.txt",
+                                     "-ic", folder + "/" + posterior.name + "_C.txt",
+                                     "-os", prefix + "_samples.txt",
+                                     "-ot", prefix + "_trajectory.txt",
+                                     "-oc", prefix + "_cost.txt",
+                                     "-ns", std::to_string(proposals),
+                                     "-nt", "10",
+                                     "-seed", std::to_string(seed)};
+    args.insert(args.end(), config.options.begin(), config.options.end());
+    std::vector<char *> argv;
+    for (auto &arg : args) argv.push_back(&arg[0]);
+
+    // Start at the prior mean, so that the cost includes burn-in
+    hmc::InversionSettings settings(static_cast<int>(argv.size()), argv.data());
+    hmc::linearSampler sampler(settings);
+    arma::vec start = posterior.m0;
+    sampler.setStarting(start);
+    sampler.sample();
+
+    // Rebuild the chain, the samples file only holds the proposals that moved the chain (last column of the cost)
+    arma::mat samples;
+    arma::mat cost;
+    samples.load(prefix + "_samples.txt");
+    cost.load(prefix + "_cost.txt");
+    arma::uword parameters = posterior.m_post.n_elem;
+    arma::vec sum = arma::zeros(parameters);
+    arma::mat sumOuter = arma::zeros(parameters, parameters);
+    arma::vec state(parameters);
+    arma::uword row = 0;
+    arma::uword interval = std::max<arma::uword>(cost.n_rows / checkpoints, 1);
+    arma::vec posteriorStd = sqrt(arma::diagvec(posterior.cm_post));
+
+    arma::mat curve = arma::zeros(cost.n_rows / interval, 5);
+    for (arma::uword it = 0; it < curve.n_rows * interval; it++) {
+        if (cost(it, 2) > 0.5) state = samples.row(row++).head(parameters).t();
+        sum += state;
+        sumOuter += state * state.t();
+        if ((it + 1) % interval == 0) {
+            double n = it + 1.0;
+            arma::vec mean = sum / n;
+            arma::mat covariance = sumOuter / n - mean * mean.t();
+            arma::uword checkpoint = (it + 1) / interval - 1;
+            curve(checkpoint, 0) = n;
+            curve(checkpoint, 1) = cost(it, 0);
+            curve(checkpoint, 2) = cost(it, 1);
+            curve(checkpoint, 3) = sqrt(arma::accu(arma::square((mean - posterior.m_post) / posteriorStd)) /
+                                        parameters);
+            curve(checkpoint, 4) = arma::norm(covariance - posterior.cm_post, "fro") /
+                                   arma::norm(posterior.cm_post, "fro");
+        }
+    }
+    curve.save(prefix + "_curve.txt", arma::raw_ascii);
+
+    return std::make_pair(cost_to_reach(curve.col(1), curve.col(3), meanErrorTarget),
+                          cost_to_reach(curve.col(1), curve.col(4), covarianceErrorTarget));
+}
+
+// Compare the convolution operator, after saving and loading it, to the dense forward model of a small problem
+bool check_convolution(const std::string &folder, arma::uword modelRows, arma::uword modelCols,
+                       const arma::mat &kernel) {
+    const double m_var = 2.0;
+    const double d_var = 0.5;
+    std::string filename = folder + "/convolution_" + std::to_string(modelCols) + "d_A_kernel.txt";
+    hmc::convolutionOperator(kernel, modelRows, modelCols, m_var, d_var).save(filename.c_str());
+    hmc::convolutionOperator loaded;
+    if (!loaded.load(filename.c_str()) || loaded.n_parameters() != modelRows * modelCols) {
+        std::cerr << "Could not load convolution operator from " << filename << "." << std::endl;
+        return false;
+    }
+
+    // Columns of G are the full convolutions of unit models with the kernel
+    arma::uword parameters = modelRows * modelCols;
+    arma::mat G((modelRows + kernel.n_rows - 1) * (modelCols + kernel.n_cols - 1), parameters);
+    for (arma::uword j = 0; j < parameters; j++) {
+        arma::mat unit = arma::zeros(modelRows, modelCols);
+        unit(j) = 1.0;
+        G.col(j) = arma::vectorise(arma::conv2(unit, kernel));
+    }
+    arma::mat A = 0.5 * (arma::eye(parameters, parameters) / m_var + G.t() * G / d_var);
+
+    arma::vec model = arma::randn(parameters);
+    arma::mat data = arma::randn(modelRows + kernel.n_rows - 1, modelCols + kernel.n_cols - 1);
+    double productError = arma::norm(loaded.apply(model) - A * model) / arma::norm(A * model);
+    double correlationError = arma::norm(loaded.correlate(data) - G.t() * arma::vectorise(data)) /
+                              arma::norm(G.t() * arma::vectorise(data));
+    double diagonalError = arma::norm(loaded.diagonal() - arma::diagvec(A)) / arma::norm(arma::diagvec(A));
+    bool matches = productError < 1e-10 && correlationError < 1e-10 && diagonalError < 1e-10;
+    std::cout << "Convolution operator " << modelRows << " x " << modelCols << ", relative errors: A m "
+              << productError << ", G^T d " << correlationError << ", diagonal " << diagonalError
+              << (matches ? "" : "\033[1;31m   mismatch\033[0m") << std::endl;
+    return matches;
+}
+
+// Read the recorded cost per problem and configuration, returns false if the file cannot be parsed
+bool read_baseline(std::ifstream &input, std::map<std::string, std::pair<double, double>> &baseline) {
+    std::string line;
+    while (std::getline(input, line)) {
+        if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+        std::istringstream entries(line);
+        std::string problemName, configName;
+        double meanCost, covarianceCost;
+        if (!(entries >> problemName >> configName >> meanCost >> covarianceCost)) {
+            std::cerr << "Invalid line in baseline file: " << line << std::endl;
+            return false;
+        }
+        // Negative costs mark targets that were not reached
+        baseline[problemName + " " + configName] = std::make_pair(
+                meanCost < 0 ? arma::datum::inf : meanCost, covarianceCost < 0 ? arma::datum::inf : covarianceCost);
+    }
+    return !baseline.empty();
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        std::cout << "Usage: accuracy_harness <output folder> <baseline file> [record]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::string folder = argv[1];
+    std::string baselineFile = argv[2];
+    bool record = argc > 3 && std::string(argv[3]) == "record";
+
+    // FFT operator of 1D and 2D deconvolutions against dense G^T G and G^T d
+    arma::arma_rng::set_seed(0);
+    if (!check_convolution(folder, 37, 1, arma::randn(5, 1)) || !check_convolution(folder, 9, 7, arma::randn(3, 4))) {
+        return EXIT_FAILURE;
+    }
+
+    // Problems with equally scaled parameters and with parameter scales spanning two orders of magnitude
+    arma::vec scales = arma::exp(arma::linspace(log(0.1), log(10.0), 20));
+    std::vector<problem> problems = {create_problem(folder, "isotropic", arma::ones(20), 1),
+                                     create_problem(folder, "scaled", scales, 2)};
+    // A unit mass matrix needs hundreds of steps per trajectory for a condition number of about 4e5
+    problems[1].excluded = {"unit"};
+
+    std::vector<configuration> configurations = {{"full",      {"-mtype", "0"}},
+                                                 {"diagonal",  {"-mtype", "1"}},
+                                                 {"unit",      {"-mtype", "2"}},
+                                                 {"lowrank",   {"-mtype", "3", "-mrank", "5"}},
+                                                 {"classic",   {"-mtype", "1", "-an", "0"}},
+                                                 {"recycle",   {"-mtype", "1", "-rt", "1"}}};
+
+    // Recorded cost per problem and configuration, only a missing file starts a new baseline
+    std::map<std::string, std::pair<double, double>> baseline;
+    std::ifstream baselineInput(baselineFile);
+    if (!baselineInput.is_open()) {
+        record = true;
+    } else if (!record && !read_baseline(baselineInput, baseline)) {
+        std::cerr << "Could not read baseline file " << baselineFile << ", use 'record' to rewrite it." << std::endl;
+        return EXIT_FAILURE;
+    }
+    baselineInput.close();
+
+    std::map<std::string, std::pair<double, double>> measured;
+    for (const auto &posterior : problems) {
+        for (const auto &config : configurations) {
+            if (std::find(posterior.excluded.begin(), posterior.excluded.end(), config.name) !=
+                posterior.excluded.end()) {
+                continue;
+            }
+            std::vector<double> meanCosts, covarianceCosts;
+            for (unsigned int seed : seeds) {
+                auto cost = run_configuration(folder, posterior, config, seed);
+                meanCosts.push_back(cost.first);
+                covarianceCosts.push_back(cost.second);
+            }
+            measured[posterior.name + " " + config.name] = std::make_pair(median(meanCosts), median(covarianceCosts));
+        }
+    }
+
+    // Report, and compare the gradient evaluations needed for the target errors to the baseline
+    bool regression = false;
+    bool unreachedTarget = false;
+    std::cout << std::endl << "Gradient evaluations to reach a mean error of " << meanErrorTarget
+              << " and a covariance error of " << covarianceErrorTarget << std::endl;
+    for (const auto &result : measured) {
+        std::cout << "\t" << std::setw(24) << std::left << result.first << std::right << std::setw(12)
+                  << result.second.first << std::setw(12) << result.second.second;
+        if (std::isinf(result.second.first) || std::isinf(result.second.second)) {
+            unreachedTarget = true;
+            std::cout << "\033[1;31m   target not reached\033[0m";
+        }
+        auto recorded = baseline.find(result.first);
+        if (!record && recorded == baseline.end()) {
+            regression = true;
+            std::cout << "\033[1;31m   missing from baseline\033[0m";
+        } else if (!record && (std::isinf(recorded->second.first) || std::isinf(recorded->second.second))) {
+            // An unreached baseline target can never be exceeded, so it cannot gate anything
+            regression = true;
+            std::cout << "\033[1;31m   target not reached in baseline\033[0m";
+        } else if (!record) {
+            bool slower = result.second.first > costTolerance * recorded->second.first ||
+                          result.second.second > costTolerance * recorded->second.second;
+            regression = regression || slower;
+            std::cout << "   baseline" << std::setw(12) << recorded->second.first << std::setw(12)
+                      << recorded->second.second << (slower ? "\033[1;31m   slower\033[0m" : "");
+        }
+        std::cout << std::endl;
+    }
+
+    if (record && unreachedTarget) {
+        std::cout << "\033[1;31mConfigurations did not reach the target errors, the baseline is not written.\033[0m"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (record) {
+        std::ofstream baselineOutput(baselineFile);
+        for (const auto &result : measured) {
+            baselineOutput << result.first << " " << result.second.first << " " << result.second.second << std::endl;
+        }
+        std::cout << "Baseline written to " << baselineFile << "." << std::endl;
+        return EXIT_SUCCESS;
+    }
+
+    if (regression) {
+        std::cout << "\033[1;31mConfigurations needed more than " << costTolerance
+                  << " times their baseline cost, or are missing or unreached in the baseline.\033[0m" << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -3,23 +3,64 @@
 //
 
 #include <cstdlib>
+#include <cstring>
 #include <armadillo>
 #include "../hmc/linearSampler.hpp"
+#include "../hmc/convolutionOperator.hpp"
 
 double X(arma::mat A, arma::colvec B, arma::mat C, arma::vec m) {
     return arma::as_scalar(m.t() * A * m + B.t() * m + C);
 }
 
-int main(int argc, char *argv[]) {
-
-    arma::mat G;
+// Quadratic form of a deconvolution, argv[1] holds the kernel instead of G and d0 is the full convolution of the model
+// with the kernel plus noise. A is written as a convolution operator (A_kernel.txt, for -iak of the sampler) and is
+// never formed, the posterior mean is found by conjugate gradients. The posterior covariance is not computed.
+int convolutionForm(char *argv[], double m_var, double d_var) {
+    arma::mat kernel;
     arma::mat d0;
 
-    G.load(argv[1]);
-    arma::vec m0 = 6.67e-4 * ones(G.n_cols, 1);
+    kernel.load(argv[1]);
     d0.load(argv[2]);
+    if (d0.n_rows < kernel.n_rows || d0.n_cols < kernel.n_cols) {
+        std::cerr << "The data should be at least as large as the kernel in every dimension." << std::endl;
+        return EXIT_FAILURE;
+    }
+    hmc::convolutionOperator A(kernel, d0.n_rows - kernel.n_rows + 1, d0.n_cols - kernel.n_cols + 1, m_var, d_var);
+    arma::vec m0 = 6.67e-4 * ones(A.n_parameters(), 1);
     m0.save(argv[3], raw_ascii);
 
+    arma::colvec B = -(m0 / m_var + A.correlate(d0) / d_var);
+    arma::mat C = 0.5 * (dot(m0, m0) / m_var + accu(square(d0)) / d_var) * ones(1, 1);
+
+    A.save("A_kernel.txt");
+    B.save("B.txt");
+    C.save("C.txt");
+
+    // Conjugate gradients on 2 A m = -B
+    arma::vec m_post = m0;
+    arma::vec residual = -B - 2.0 * A.apply(m_post);
+    arma::vec direction = residual;
+    double product = dot(residual, residual);
+    double tolerance = 1e-20 * dot(B, B);
+    for (arma::uword it = 0; it < B.n_elem && product > tolerance; it++) {
+        arma::vec hessianDirection = 2.0 * A.apply(direction);
+        double step = product / dot(direction, hessianDirection);
+        m_post += step * direction;
+        residual -= step * hessianDirection;
+        double productNew = dot(residual, residual);
+        direction = residual + (productNew / product) * direction;
+        product = productNew;
+    }
+
+    cout << dot(m_post, A.apply(m_post)) + dot(B, m_post) + C(0, 0);
+
+    m_post.save("m_post.txt");
+
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+
     std::stringstream m_var_s(argv[4]);
     double m_var;
     m_var_s >> m_var;
@@ -27,6 +68,18 @@ int main(int argc, char *argv[]) {
     double d_var;
     d_var_s >> d_var;
 
+    if (argc > 6 && strcmp(argv[6], "convolution") == 0) {
+        return convolutionForm(argv, m_var, d_var);
+    }
+
+    arma::mat G;
+    arma::mat d0;
+
+    G.load(argv[1]);
+    arma::vec m0 = 6.67e-4 * ones(G.n_cols, 1);
+    d0.load(argv[2]);
+    m0.save(argv[3], raw_ascii);
+
     arma::sp_mat G_sp = sp_mat(G);
     arma::sp_mat cm = m_var * speye<sp_mat>(m0.n_rows, m0.n_rows);
     arma::sp_mat cd = d_var * speye<sp_mat>(d0.n_rows, d0.n_rows);
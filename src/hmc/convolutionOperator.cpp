@@ -0,0 +1,79 @@
+/*
+ * Quadratic form of a linear convolutional forward model, applied with FFTs.
+ */
+#include <fstream>
+#include <iomanip>
+#include "convolutionOperator.hpp"
+
+using namespace arma;
+
+namespace hmc {
+    namespace {
+        // Smallest power of two of at least size, transforms of these lengths are fastest.
+        uword fft_length(uword size) {
+            uword length = 1;
+            while (length < size) length *= 2;
+            return length;
+        }
+    }
+
+    convolutionOperator::convolutionOperator(const mat &_kernel, uword _modelRows, uword _modelCols,
+                                             double _priorVariance, double _dataVariance) :
+            kernel(_kernel), modelRows(_modelRows), modelCols(_modelCols), priorVariance(_priorVariance),
+            dataVariance(_dataVariance) {
+        prepare();
+    }
+
+    void convolutionOperator::prepare() {
+        // The full convolution fits in the transform without wrap-around
+        fftRows = fft_length(modelRows + kernel.n_rows - 1);
+        fftCols = fft_length(modelCols + kernel.n_cols - 1);
+        kernelSpectrum = fft2(kernel, fftRows, fftCols);
+        kernelPower = real(kernelSpectrum % conj(kernelSpectrum));
+    }
+
+    bool convolutionOperator::load(const char *filename) {
+        std::ifstream file(filename);
+        if (!(file >> modelRows >> modelCols >> priorVariance >> dataVariance)) return false;
+        // Skip the end of the header line, the raw ascii reader stops at the first empty line
+        file >> std::ws;
+        if (!kernel.load(file, raw_ascii) || kernel.is_empty() || modelRows * modelCols == 0) return false;
+        prepare();
+        return true;
+    }
+
+    bool convolutionOperator::save(const char *filename) const {
+        std::ofstream file(filename);
+        file << modelRows << " " << modelCols << " " << std::setprecision(20) << priorVariance << " " << dataVariance
+             << std::endl;
+        return kernel.save(file, raw_ascii) && file.good();
+    }
+
+    vec convolutionOperator::apply(const vec &model) const {
+        // G^T G m is the circular convolution of the zero padded model with the autocorrelation of the kernel
+        mat modelMatrix(const_cast<double *>(model.memptr()), modelRows, modelCols, false, true);
+        mat product = real(ifft2(fft2(modelMatrix, fftRows, fftCols) % kernelPower));
+        return 0.5 * (model / priorVariance + vectorise(product.submat(0, 0, modelRows - 1, modelCols - 1)) / dataVariance);
+    }
+
+    vec convolutionOperator::correlate(const mat &data) const {
+        mat product = real(ifft2(fft2(data, fftRows, fftCols) % conj(kernelSpectrum)));
+        return vectorise(product.submat(0, 0, modelRows - 1, modelCols - 1));
+    }
+
+    vec convolutionOperator::diagonal() const {
+        return 0.5 * (1.0 / priorVariance + accu(square(kernel)) / dataVariance) * ones<vec>(n_parameters());
+    }
+
+    uword convolutionOperator::n_parameters() const {
+        return modelRows * modelCols;
+    }
+
+    double convolutionOperator::data_variance() const {
+        return dataVariance;
+    }
+
+    double convolutionOperator::prior_variance() const {
+        return priorVariance;
+    }
+}
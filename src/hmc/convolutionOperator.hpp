@@ -0,0 +1,95 @@
+/*
+ * Quadratic form of a linear convolutional forward model, applied with FFTs.
+ */
+
+#ifndef HMC_LINEAR_SYSTEM_CONVOLUTIONOPERATOR_HPP
+#define HMC_LINEAR_SYSTEM_CONVOLUTIONOPERATOR_HPP
+
+#include <armadillo>
+
+namespace hmc {
+    /** \brief Matrix A of the quadratic form of a deconvolution problem, without forming it.
+      *
+      * The forward model G is the full (linear) convolution of a model of modelRows x modelCols parameters with a
+      * kernel, so that the data has (modelRows + kernelRows - 1) x (modelCols + kernelCols - 1) entries. 1D problems
+      * use a single column. With prior and data covariances that are multiples of the identity,
+      * \f$ A = \frac{1}{2} (C_m^{-1} + G^T C_d^{-1} G) \f$. Products with A cost O(n log n) through FFTs padded to avoid
+      * wrap-around, instead of the O(n^2) of a dense matrix.
+      * */
+    class convolutionOperator {
+    public:
+        convolutionOperator() = default;
+
+        /** \brief Constructor from a kernel and the shape of the model.
+          * \param kernel Convolution kernel, a column vector for 1D problems.
+          * \param modelRows Number of rows of the model.
+          * \param modelCols Number of columns of the model, 1 for 1D problems.
+          * \param priorVariance Prior variance of the parameters.
+          * \param dataVariance Variance of the data.
+          * \return convolutionOperator object
+          * */
+        convolutionOperator(const arma::mat &kernel, arma::uword modelRows, arma::uword modelCols, double priorVariance,
+                            double dataVariance);
+
+        /** \brief Load the operator, the first line holds the model rows, model columns, prior variance and data
+          * variance, the following lines hold the kernel.
+          * \param filename File to load.
+          * \return Whether loading succeeded.
+          * */
+        bool load(const char *filename);
+
+        /** \brief Save the operator in the format read by load().
+          * \param filename File to save.
+          * \return Whether saving succeeded.
+          * */
+        bool save(const char *filename) const;
+
+        /** \brief Product with A.
+          * \param model Vectorized (column major) model.
+          * \return A m
+          * */
+        arma::vec apply(const arma::vec &model) const;
+
+        /** \brief Product with the transposed forward model, \f$ G^T d \f$.
+          * \param data Data of (modelRows + kernelRows - 1) x (modelCols + kernelCols - 1) entries.
+          * \return Vectorized (column major) result.
+          * */
+        arma::vec correlate(const arma::mat &data) const;
+
+        /** \brief Diagonal of A, every shift of the kernel lies fully within the data so it is constant.
+          * \return Diagonal of A.
+          * */
+        arma::vec diagonal() const;
+
+        /** \brief Number of parameters of the model.
+          * \return Number of parameters.
+          * */
+        arma::uword n_parameters() const;
+
+        /** \brief Variance of the data.
+          * \return Variance of the data.
+          * */
+        double data_variance() const;
+
+        /** \brief Variance of the prior.
+          * \return Variance of the prior.
+          * */
+        double prior_variance() const;
+
+    private:
+        arma::mat kernel; ///< Convolution kernel.
+        arma::cx_mat kernelSpectrum; ///< Zero padded Fourier transform of the kernel.
+        arma::mat kernelPower; ///< Squared magnitude of the kernel spectrum, the spectrum of G^T G.
+        arma::uword modelRows = 0; ///< Number of rows of the model.
+        arma::uword modelCols = 0; ///< Number of columns of the model.
+        arma::uword fftRows = 0; ///< Padded number of rows of the transforms.
+        arma::uword fftCols = 0; ///< Padded number of columns of the transforms.
+        double priorVariance = 1.0; ///< Prior variance of the parameters.
+        double dataVariance = 1.0; ///< Variance of the data.
+
+        // Compute the padded spectra of the kernel
+        void prepare();
+    };
+}
+
+#endif //HMC_LINEAR_SYSTEM_CONVOLUTIONOPERATOR_HPP
@@ -5,6 +5,10 @@
 #include <cmath>
 #include <sstream>
 #include <iomanip>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
 #include "linearSampler.hpp"
 #include "../random/randomnumbers.hpp"
 
@@ -18,11 +22,14 @@ namespace hmc {
         // Output files
         _outputSamples = settings._outputSamplesFile;
         _outputTrajectory = settings._outputTrajectoryFile;
+        _outputCost = settings._outputCostFile;
 
         // Forward model
         A_file = settings.A_file;
+        A_kernel_file = settings.A_kernel_file;
         B_file = settings.B_file;
         C_file = settings.C_file;
+        batchFile = settings._batchFile;
 
         // Tuning parameters
         dt = settings._timeStep;
@@ -30,9 +37,27 @@ namespace hmc {
         proposals = settings._proposals;
         nt = settings._trajectorySteps;
         massMatrixType = settings._massMatrixType;
+        massMatrixRank = settings._massMatrixRank;
+
+        // Parallel tempering
+        temperingChains = settings._temperingChains;
+        temperingSwapInterval = settings._temperingSwapInterval;
+        temperingMaximum = settings._temperingMaximum;
+        temperingAdapt = settings._temperingAdapt;
+
+        // Algorithm
+        algorithmNew = settings._algorithmNew;
+        testBefore = settings._testBefore;
+        recycleTrajectory = settings._recycleTrajectory;
+        trajectoryInterval = settings._trajectoryInterval;
+        if (temperingChains > 1 && (temperingMaximum <= temperature || temperingSwapInterval == 0)) {
+            std::cerr << "Invalid temperature ladder, the hottest chain should be hotter than the coldest chain and the "
+                         "swap interval should be positive. Sampling a single chain." << std::endl;
+            temperingChains = 1;
+        }
 
         // Initialise random number generator
-        srand((unsigned int) time(nullptr));
+        randn_seed(settings._seed > 0 ? (unsigned int) settings._seed : (unsigned int) time(nullptr));
 
         // Show version
         std::cout << std::endl << "Hamiltonian Monte Carlo Sampler" << std::endl << "Lars Gebraad, version 2 - Summer 2018" << std::endl
@@ -42,31 +67,48 @@ namespace hmc {
         auto startCPU = get_cpu_time();
         auto startWall = get_wall_time();
         std::cout << "Loading equation ..." << std::endl;
-        A.load(A_file);
-        B.load(B_file);
-        mat C_mat;
-        C_mat.load(C_file);
-        C = C_mat[0];
+        structuredA = strlen(A_kernel_file) > 0;
+        if (structuredA) {
+            if (!convolution.load(A_kernel_file)) {
+                std::cerr << "Could not load convolution operator from " << A_kernel_file << "." << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            parameters = convolution.n_parameters();
+        } else {
+            A.load(A_file);
+            parameters = A.n_rows;
+        }
         std::cout << "Matrices loaded." << std::endl;
 
         // Start pre-computation
         startCPU = std::clock();
         startWall = get_wall_time();
         // Perform mass pre-computations
-        At = A.t();
-        massMatrix = 0.5 * (A + At);
-        if (arma::approx_equal(massMatrix, A, "rel_tol", 0.01)) {
+        if (structuredA) {
+            // The convolution operator is symmetric by construction, and is only available through products.
             symmetricA = true;
-            // If matrix is symmetric, we don't need to `remember' its transpose.
-            At.clear();
-        }
-        // Check for mass matrix type and modify accordingly.
-        if (massMatrixType == 1) {
-            massMatrix = diagvec(massMatrix);
-        } else if (massMatrixType == 2) {
-            // This is not optimally placed, as when we truly want to use eye, we shouldn't want to compute A+At for
-            // the mass matrix. However, this is still necessary to calculate the symmetry condition.
-            massMatrix = ones(massMatrix.n_rows, 1);
+            if (massMatrixType == 0) {
+                std::cerr << "The full mass matrix requires a dense A, using the low rank plus diagonal mass matrix."
+                          << std::endl;
+                massMatrixType = 3;
+            }
+            massMatrix = massMatrixType == 2 ? mat(ones(parameters, 1)) : mat(convolution.diagonal());
+        } else {
+            At = A.t();
+            massMatrix = 0.5 * (A + At);
+            if (arma::approx_equal(massMatrix, A, "rel_tol", 0.01)) {
+                symmetricA = true;
+                // If matrix is symmetric, we don't need to `remember' its transpose.
+                At.clear();
+            }
+            // Check for mass matrix type and modify accordingly.
+            if (massMatrixType == 1) {
+                massMatrix = diagvec(massMatrix);
+            } else if (massMatrixType == 2) {
+                // This is not optimally placed, as when we truly want to use eye, we shouldn't want to compute A+At for
+                // the mass matrix. However, this is still necessary to calculate the symmetry condition.
+                massMatrix = ones(massMatrix.n_rows, 1);
+            }
         }
         // Perform necessary precomputations
         if (massMatrixType == 0) {
@@ -79,34 +121,58 @@ namespace hmc {
             std::cout << "Inverting mass using Cholesky decomposition." << std::endl;
             invMass = invChol.t() * invChol;
             std::cout << "Inverted mass using Cholesky decomposition." << std::endl;
+        } else if (massMatrixType == 3) {
+            std::cout << "Approximating mass matrix by diagonal plus rank " << massMatrixRank << "." << std::endl;
+            low_rank_mass();
+            std::cout << "Approximated mass matrix." << std::endl;
         } else {
             invMass = 1.0 / massMatrix;
+            rootMassMatrix = sqrt(massMatrix);
         }
 
-        // Set starting proposal
-        propose_momentum();
-        _proposedModel = (massMatrixType == 0) ?
-                         (-2 * invMass * B) :
-                         symmetricA ? arma::conv_to<vec>::from(-inv(2 * A) * B) : arma::conv_to<vec>::from(-inv(At + A) * B);
+        // Operator mapping B to the minimum of the quadratic form, for the full mass matrix this is -M^-1 / 2. The
+        // low rank mass matrix and the convolution operator find the minimum iteratively instead.
+        if (!structuredA && (massMatrixType == 1 || massMatrixType == 2)) {
+            modeOperator = symmetricA ? mat(-inv(2 * A)) : mat(-inv(At + A));
+        }
 
-        // Set starting model
-        _currentModel = _proposedModel;
+        // Load the data of a single inversion and set starting model at the minimum of the quadratic form
+        if (strlen(batchFile) == 0) {
+            if (!load_data(B_file, C_file, _data)) exit(EXIT_FAILURE);
+            _currentModel = _data.posteriorMode;
+        }
 
-        // Do analysis of the product _A * massMatrix to determine optimal time step
-        if (settings._adaptTimestep) {
-            double maxFrequency;
+        // Do analysis of the product _A * massMatrix to determine optimal time step and the bounds for the energy
+        // pre-test. The largest eigenvalue of M^-1 A is found from the symmetric matrix M^-1/2 A M^-1/2.
+        double maxFrequency = 1.0;
+        if (!structuredA && (massMatrixType == 1 || massMatrixType == 2) && (settings._adaptTimestep || (algorithmNew && testBefore))) {
             arma::vec eigval;
-            arma::mat eigvec;
+            arma::vec rootInvMass = sqrt(conv_to<vec>::from(invMass));
+            eig_sym(eigval, diagmat(rootInvMass) * (symmetricA ? A : mat(0.5 * (A + At))) * diagmat(rootInvMass));
+            maxFrequency = arma::max(eigval);
+        }
+        maxFrequencySquared = 2.0 * maxFrequency; // Hessian of the misfit is 2 A
+        if (massMatrixType == 3 || structuredA) {
+            // Power iteration on M^-1 A only estimates the largest eigenvalue from below. This suffices for the time
+            // step, but not for the bound of the energy pre-test, which is therefore disabled.
+            vec iterate(parameters);
+            randn_fill(iterate.memptr(), iterate.n_elem);
+            for (int it = 0; it < 100; it++) {
+                iterate = inverse_mass(symmetric_product(iterate));
+                iterate /= norm(iterate);
+            }
+            maxFrequency = norm(inverse_mass(symmetric_product(iterate)));
+            maxFrequencySquared = datum::inf;
+            testBefore = false;
+        }
+        if (settings._adaptTimestep) {
             switch (massMatrixType) {
                 case 0:
                     dt = (2.0 * PI / nt);
                     break;
                 case 1:
                 case 2:
-                    eig_sym(eigval, eigvec, diagmat(invMass) * A);
-                    maxFrequency = arma::max(eigval);
-                    eigval.clear();
-                    eigvec.clear();
+                case 3:
                     dt = (2.0 * PI / nt) * 0.61497 / sqrt(maxFrequency); // Randomization, if 0.61497 ==> 1: oscillatory samples
                     break;
 
@@ -121,141 +187,579 @@ namespace hmc {
         // Output settings
         std::cout << "Inversion of linear model using MCMC sampling." << std::endl;
         std::cout << "\033[1;34m Hamiltonian Monte Carlo\033[0m with following options:" << std::endl;
-        std::cout << "\t parameters:        \033[1;32m" << _currentModel.size() << "\033[0m" << std::endl;
+        std::cout << "\t parameters:        \033[1;32m" << parameters << "\033[0m" << std::endl;
         std::cout << "\t proposals:         \033[1;32m" << proposals << "\033[0m" << std::endl;
         std::cout << "\t temperature:       \033[1;32m" << temperature << "\033[0m" << std::endl;
         std::cout << "\t timestep:          \033[1;32m" << dt << "\033[0m" << std::endl;
         std::cout << "\t number of steps:   \033[1;32m" << nt << "\033[0m" << std::endl << std::endl;
+        if (temperingChains > 1) {
+            std::cout << "\t tempered chains:   \033[1;32m" << temperingChains << "\033[0m" << std::endl;
+            std::cout << "\t max temperature:   \033[1;32m" << temperingMaximum << "\033[0m" << std::endl;
+            std::cout << "\t swap interval:     \033[1;32m" << temperingSwapInterval << "\033[0m" << std::endl;
+            std::cout << "\t adaptive ladder:   \033[1;32m" << (temperingAdapt ? "true" : "false") << "\033[0m" << std::endl
+                      << std::endl;
+        }
+        std::cout << "\t algorithm:         \033[1;32m" << (algorithmNew ? "new" : "classic") << "\033[0m" << std::endl;
+        std::cout << "\t energy pre-test:   \033[1;32m" << (algorithmNew && testBefore && !recycleTrajectory ? "true" : "false")
+                  << "\033[0m" << std::endl;
+        std::cout << "\t recycle trajectory:\033[1;32m" << (recycleTrajectory ? "true" : "false") << "\033[0m" << std::endl;
         std::cout << "\t Optimal timestep:  \033[1;32m" << (settings._adaptTimestep ? "true" : "false") << "\033[0m" << std::endl;
         std::cout << "\t mass matrix type:  \033[1;32m" << (massMatrixType == 0 ? "full optimal matrix" :
-                                                            (massMatrixType == 1 ? "diagonal optimal matrix" : "unit matrix"))
+                                                            (massMatrixType == 1 ? "diagonal optimal matrix" :
+                                                             (massMatrixType == 2 ? "unit matrix" :
+                                                              "low rank plus diagonal matrix")))
                   << "\033[0m" << std::endl << std::endl;
-        std::cout << "\t output samples:    \033[1;32m" << _outputSamples << "\033[0m" << std::endl;
+        if (strlen(batchFile) == 0) {
+            std::cout << "\t output samples:    \033[1;32m" << _outputSamples << "\033[0m" << std::endl;
+        } else {
+            std::cout << "\t batch file:        \033[1;32m" << batchFile << "\033[0m" << std::endl;
+        }
         std::cout << "\t output trajectory: \033[1;32m" << _outputTrajectory << "\033[0m" << std::endl;
-        std::cout << "\t Diagonal matrix:   \033[1;32m" << (symmetricA ? "yes" : "no") << "\033[0m" << std::endl << std::endl;
+        std::cout << "\t Diagonal matrix:   \033[1;32m" << (symmetricA ? "yes" : "no") << "\033[0m" << std::endl;
+        std::cout << "\t FFT operator:      \033[1;32m" << (structuredA ? A_kernel_file : "no") << "\033[0m" << std::endl
+                  << std::endl;
     };
 
     void linearSampler::setStarting(arma::vec &model) {
         _currentModel = model;
-        _proposedModel = model;
     }
 
-    void linearSampler::propose_momentum() {
-        // Draw random prior momenta according to the distribution defined by the mass matrix.
+    bool linearSampler::load_data(const char *B_path, const char *C_path, quadraticData &data) {
+        mat C_mat;
+        if (!data.B.load(B_path) || data.B.n_elem != parameters) {
+            std::cerr << "Could not load B from " << B_path << ", expected " << parameters << " entries." << std::endl;
+            return false;
+        }
+        if (!C_mat.load(C_path) || C_mat.n_elem != 1) {
+            std::cerr << "Could not load C from " << C_path << ", expected a single entry." << std::endl;
+            return false;
+        }
+        data.C = C_mat[0];
         if (massMatrixType == 0) {
-            _proposedMomentum = randn_Cholesky(CholeskyLowerMassMatrix);
+            data.posteriorMode = -0.5 * invMass * data.B;
+        } else if (massMatrixType == 3 || structuredA) {
+            data.posteriorMode = solve_mode(data.B);
         } else {
-            _proposedMomentum = randn(conv_to<vec>::from(massMatrix));
+            data.posteriorMode = modeOperator * data.B;
         }
+        data.minimumMisfit = misfit(data, data.posteriorMode);
+        return true;
     }
 
-    double linearSampler::misfit() {
-        return as_scalar(_proposedModel.t() * (A * _proposedModel) + B.t() * _proposedModel + C);
+    void linearSampler::propose_momentum(vec &momentum, double chainTemperature) {
+        // Draw random prior momenta according to the distribution defined by the (tempered) mass matrix.
+        if (massMatrixType == 0) {
+            randn_Cholesky_fill(CholeskyLowerMassMatrix, momentum);
+        } else {
+            randn_fill(rootMassMatrix, momentum);
+        }
+        if (massMatrixType == 3) {
+            // Adding F z to D^1/2 z' gives covariance D + F F^T
+            vec lowRankSamples(massFactor.n_cols);
+            randn_fill(lowRankSamples.memptr(), lowRankSamples.n_elem);
+            momentum += massFactor * lowRankSamples;
+        }
+        if (chainTemperature != 1.0) momentum *= sqrt(chainTemperature);
     }
 
-    double linearSampler::kineticEnergy() {
-        return 0.5 * ((massMatrixType == 0) ?
-                      as_scalar(_proposedMomentum.t() * invMass * _proposedMomentum) :
-                      dot(_proposedMomentum % invMass, _proposedMomentum));
+    double linearSampler::misfit(const quadraticData &data, const vec &model) {
+        if (structuredA) return dot(model, convolution.apply(model)) + dot(data.B, model) + data.C;
+        return as_scalar(model.t() * (A * model) + data.B.t() * model + data.C);
+    }
 
+    vec linearSampler::gradient(const quadraticData &data, const vec &model) {
+#pragma omp atomic
+        gradientEvaluations++;
+        if (structuredA) return 2.0 * convolution.apply(model) + data.B;
+        return symmetricA ?
+               arma::conv_to<vec>::from(2 * A * model + data.B) :
+               arma::conv_to<vec>::from(At * model + A * model + data.B);
     }
 
-    double linearSampler::chi() {
-        return misfit();
+    vec linearSampler::symmetric_product(const vec &model) {
+        if (structuredA) return convolution.apply(model);
+        return symmetricA ? conv_to<vec>::from(A * model) : conv_to<vec>::from(0.5 * (A * model + At * model));
     }
 
-    double linearSampler::energy() {
-        return chi() + kineticEnergy();
+    mat linearSampler::symmetric_product(const mat &models) {
+        if (!structuredA) return symmetricA ? mat(A * models) : mat(0.5 * (A * models + At * models));
+        mat products(models.n_rows, models.n_cols);
+        for (arma::uword column = 0; column < models.n_cols; column++) {
+            products.col(column) = convolution.apply(models.col(column));
+        }
+        return products;
+    }
+
+    vec linearSampler::inverse_mass(const vec &momentum) {
+        switch (massMatrixType) {
+            case 0:
+                return invMass * momentum;
+            case 3:
+                // Woodbury identity, (D + F F^T)^-1 = D^-1 - D^-1 F (I + F^T D^-1 F)^-1 F^T D^-1
+                return invMass % momentum - woodburyFactor * (woodburyCore * (woodburyFactor.t() * momentum));
+            default:
+                return invMass % momentum;
+        }
+    }
+
+    double linearSampler::kineticEnergy(const vec &momentum) {
+        return 0.5 * dot(momentum, inverse_mass(momentum));
+    }
+
+    void linearSampler::low_rank_mass() {
+        // Randomized eigendecomposition of the symmetric part of A, using a range finder with oversampling and power
+        // iterations.
+        arma::uword n = parameters;
+        arma::uword rank = std::min<arma::uword>(massMatrixRank, n);
+        arma::uword samples = std::min<arma::uword>(rank + 10, n);
+        mat range(n, samples);
+        randn_fill(range.memptr(), range.n_elem);
+        mat Q, R;
+        mat product = symmetric_product(range);
+        for (int it = 0; it < 2; it++) {
+            qr_econ(Q, R, product);
+            product = symmetric_product(Q);
+        }
+        qr_econ(Q, R, product);
+        mat projected = Q.t() * symmetric_product(Q);
+        vec eigval;
+        mat eigvec;
+        eig_sym(eigval, eigvec, mat(0.5 * (projected + projected.t())));
+
+        // Keep the largest positive eigenvalues, M = D + F F^T with F = V L^1/2
+        eigval = clamp(eigval.tail(rank), 0.0, datum::inf);
+        massFactor = (Q * eigvec.tail_cols(rank)) * diagmat(sqrt(eigval));
+
+        // The diagonal matches the diagonal of A, bounded from below to keep the mass matrix positive definite
+        vec diagonal = structuredA ? convolution.diagonal() : conv_to<vec>::from(diagvec(massMatrix));
+        vec remainder = diagonal - sum(square(massFactor), 1);
+        vec lowerBound = 1e-3 * abs(diagonal);
+        massMatrix = arma::max(remainder, lowerBound);
+        invMass = 1.0 / massMatrix;
+        rootMassMatrix = sqrt(massMatrix);
+
+        woodburyFactor = massFactor;
+        woodburyFactor.each_col() %= conv_to<vec>::from(invMass);
+        woodburyCore = inv_sympd(eye(rank, rank) + massFactor.t() * woodburyFactor);
+    }
+
+    vec linearSampler::solve_mode(const colvec &B) {
+        // Preconditioned conjugate gradients on 2 A m = -B, preconditioned by the mass matrix
+        vec mode = zeros(B.n_elem);
+        vec residual = -B;
+        vec preconditioned = 0.5 * inverse_mass(residual);
+        vec direction = preconditioned;
+        double product = dot(residual, preconditioned);
+        double tolerance = 1e-20 * dot(B, B);
+        for (arma::uword it = 0; it < B.n_elem && dot(residual, residual) > tolerance; it++) {
+            vec hessianDirection = 2.0 * symmetric_product(direction);
+            double step = product / dot(direction, hessianDirection);
+            mode += step * direction;
+            residual -= step * hessianDirection;
+            preconditioned = 0.5 * inverse_mass(residual);
+            double productNew = dot(residual, preconditioned);
+            direction = preconditioned + (productNew / product) * direction;
+            product = productNew;
+        }
+        return mode;
+    }
+
+    bool linearSampler::accept_before_propagation(const quadraticData &data, const vec &model, const vec &misfitGrad,
+                                                  double hamiltonian, double timeStep, double threshold) {
+        // Leapfrog exactly conserves the shadow Hamiltonian H - dt^2/8 g^T M^-1 g of a quadratic form. The difference
+        // of the final Hamiltonian with it is bounded through the largest frequency of the system.
+        double stability = maxFrequencySquared * timeStep * timeStep / 4.0;
+        if (stability >= 1.0) return false;
+        double gradientNorm = (massMatrixType == 0) ?
+                              2.0 * dot(misfitGrad, model - data.posteriorMode) : // M^-1 g = 2 (m - m*) for the full mass
+                              dot(misfitGrad, inverse_mass(misfitGrad));
+        double shadowHamiltonian = hamiltonian - timeStep * timeStep * gradientNorm / 8.0;
+        double upperBound = shadowHamiltonian + stability / (1.0 - stability) * (shadowHamiltonian - data.minimumMisfit);
+        return upperBound <= threshold;
+    }
+
+    bool linearSampler::hmc_transition(const quadraticData &data, vec &model, double &modelMisfit,
+                                       double chainTemperature, bool writeTrajectory) {
+        if (recycleTrajectory) return multinomial_transition(data, model, modelMisfit, chainTemperature, writeTrajectory);
+
+        // Propose new momentum
+        vec momentum;
+        propose_momentum(momentum, chainTemperature);
+        double x = modelMisfit + kineticEnergy(momentum);
+
+        // Randomize settings as to ensure ergodicity
+        auto local_nt = static_cast<unsigned long>(nt * randf(0.5, 1.5));
+        double local_dt = dt * randf(0.5, 1.5);
+        vec misfitGrad = gradient(data, model);
+
+        // The new algorithm draws the acceptance threshold for the final Hamiltonian before propagating, which allows
+        // the energy pre-test to decide on acceptance beforehand.
+        double threshold = 0;
+        bool acceptedByBound = false;
+        if (algorithmNew) {
+            threshold = x - chainTemperature * log(randf(0.0, 1.0));
+            if (testBefore) acceptedByBound = accept_before_propagation(data, model, misfitGrad, x, local_dt, threshold);
+        }
+
+        // Propagate, the final momentum is not needed if acceptance is already decided
+        vec proposal = model;
+        leap_frog(data, proposal, momentum, misfitGrad, local_nt, local_dt, writeTrajectory, !acceptedByBound);
+        double proposalMisfit = 0.5 * dot(proposal, misfitGrad + data.B) + data.C;
+
+        // Calculate new Hamiltonian and evaluate acceptance criterion
+        bool accept = acceptedByBound;
+        if (acceptedByBound) {
+#pragma omp atomic
+            decidedByBound++;
+        } else {
+            double x_new = proposalMisfit + kineticEnergy(momentum);
+            accept = algorithmNew ?
+                     (x_new <= threshold) :
+                     ((x_new < x) || (exp((x - x_new) / chainTemperature) > randf(0.0, 1.0)));
+        }
+
+        if (accept) {
+            model = proposal;
+            modelMisfit = proposalMisfit;
+        }
+        return accept;
+    }
+
+    bool linearSampler::multinomial_transition(const quadraticData &data, vec &model, double &modelMisfit,
+                                               double chainTemperature, bool writeTrajectory) {
+        // Propose new momentum
+        vec momentum;
+        propose_momentum(momentum, chainTemperature);
+        double x = modelMisfit + kineticEnergy(momentum);
+
+        // Randomize settings as to ensure ergodicity, and place the starting state uniformly within the trajectory
+        auto local_nt = static_cast<unsigned long>(nt * randf(0.5, 1.5));
+        double local_dt = dt * randf(0.5, 1.5);
+        auto backwardSteps = std::min(local_nt, static_cast<unsigned long>(randf(0.0, 1.0) * (local_nt + 1)));
+        vec startGrad = gradient(data, model);
+
+        // Progressive multinomial selection over all states, weights exp(-(H - x) / T) are kept in log space
+        double logWeightSum = 0.0;
+        bool moved = false;
+        vec selected;
+        double selectedMisfit = modelMisfit;
+
+        // The backward half is buffered so that the trajectory is written in time order
+        std::vector<std::pair<vec, double>> backwardStates;
+        for (double direction : {-1.0, 1.0}) {
+            if (writeTrajectory && direction > 0) {
+                for (auto state = backwardStates.rbegin(); state != backwardStates.rend(); ++state) {
+                    write_sample(trajectoryfile, state->first, state->second);
+                }
+                write_sample(trajectoryfile, model, modelMisfit);
+            }
+            unsigned long steps = (direction < 0) ? backwardSteps : local_nt - backwardSteps;
+            vec state = model;
+            vec stateMomentum = direction * momentum;
+            vec misfitGrad = startGrad;
+            vec velocity;
+
+            for (unsigned long it = 0; it < steps; it++) {
+                stateMomentum -= 0.5 * local_dt * misfitGrad;
+                velocity = inverse_mass(stateMomentum);
+                state += local_dt * velocity;
+                misfitGrad = gradient(data, state);
+
+                // Energy of the state, the kinetic energy of the full step momentum p - h g is expanded so that it
+                // reuses the velocity at the half step. The remaining term g^T M^-1 g follows from the gradient for
+                // the full mass matrix (M = A), other mass matrices need one more product with the inverse mass.
+                double stateMisfit = 0.5 * dot(state, misfitGrad + data.B) + data.C;
+                double gradientNorm = (massMatrixType == 0) ?
+                                      2.0 * dot(misfitGrad, state - data.posteriorMode) :
+                                      dot(misfitGrad, inverse_mass(misfitGrad));
+                double h = 0.5 * local_dt;
+                double kinetic = 0.5 * dot(stateMomentum, velocity) - h * dot(misfitGrad, velocity) +
+                                 0.5 * h * h * gradientNorm;
+                stateMomentum -= h * misfitGrad;
+
+                double logWeight = (x - stateMisfit - kinetic) / chainTemperature;
+                logWeightSum = std::max(logWeightSum, logWeight) + log1p(exp(-std::abs(logWeightSum - logWeight)));
+                if (exp(logWeight - logWeightSum) > randf(0.0, 1.0)) {
+                    selected = state;
+                    selectedMisfit = stateMisfit;
+                    moved = true;
+                }
+                if (writeTrajectory) {
+                    if (direction < 0) {
+                        backwardStates.emplace_back(state, stateMisfit);
+                    } else {
+                        write_sample(trajectoryfile, state, stateMisfit);
+                    }
+                }
+            }
+        }
+        if (writeTrajectory) trajectoryfile << std::endl;
+
+        if (moved) {
+            model = selected;
+            modelMisfit = selectedMisfit;
+        }
+        return moved;
     }
 
     void linearSampler::sample_neal() {
+        run_chain(_data, _currentModel, _outputSamples, true);
+    }
+
+    unsigned long linearSampler::run_chain(const quadraticData &data, vec &model, const char *outputSamples,
+                                           bool interactive) {
         // Sample the distribution using the modified algorithm
-        double x = energy();
-        double x_new;
-        int accepted = 1;
+        double currentMisfit = misfit(data, model);
+        unsigned long accepted = 1;
 
         // Open output file and write starting model
         std::ofstream samplesfile;
-        samplesfile.open(_outputSamples);
-        write_sample(samplesfile, chi());
+        samplesfile.open(outputSamples);
+        write_sample(samplesfile, model, currentMisfit);
+        if (interactive) trajectoryfile.open(_outputTrajectory);
+
+        // Cost of every proposal, the last column marks the proposals that added a line to the samples file
+        std::ofstream costfile;
+        double startWall = get_wall_time();
+        if (interactive && strlen(_outputCost) > 0) {
+            costfile.open(_outputCost);
+            costfile << gradientEvaluations << " " << 0.0 << " " << 1 << std::endl;
+        }
 
         // Write progress in percentages to console
-        std::cout << "[" << std::setw(3) << (int) (100.0 * double(0) / proposals) << "%] "
+        if (interactive) std::cout << "[" << std::setw(3) << (int) (100.0 * double(0) / proposals) << "%] "
                   << std::string(((unsigned long) ((window.ws_col - 7) * 0 / proposals)), *"=") <<
                   "\r" << std::flush;
 
         // Perform sampling
         for (int it = 1; it < proposals; it++) {
             // Write progress to console every 100 steps
-            if (it % 100 == 0) {
+            if (interactive && it % 100 == 0) {
                 std::cout << "[" << std::setw(3) << (int) (100.0 * double(it) / proposals) << "%] "
                           << std::string(((unsigned long) ((window.ws_col - 7) * it / proposals)), *"=") <<
                           "\r" << std::flush;
             }
 
-            // Propose new momentum and propagate
-            propose_momentum();
-            x = energy();
-            leap_frog(it == proposals - 1);
-
-            // Calculate new Hamiltonian
-            x_new = energy();
-
-            // Evaluate acceptance criterion
-            double result_exponent = exp((x - x_new) / temperature);
-            if ((x_new < x) || (result_exponent > randf(0.0, 1.0))) {
+            bool writeTrajectory = interactive &&
+                                   ((it == proposals - 1) || (trajectoryInterval > 0 && it % trajectoryInterval == 0));
+            bool moved = hmc_transition(data, model, currentMisfit, temperature, writeTrajectory);
+            if (moved) {
                 accepted++;
-                x = x_new;
-                _currentModel = _proposedModel;
-                write_sample(samplesfile, chi());
+                write_sample(samplesfile, model, currentMisfit);
+            }
+            if (costfile.is_open()) {
+                costfile << gradientEvaluations << " " << get_wall_time() - startWall << " " << moved << std::endl;
             }
         }
 
         // Write out 100% at the end
-        std::cout << "[" << 100 << "%] " << std::string((unsigned long) (window.ws_col - 7), *"=") << "\r\n"
-                  << std::flush;
-        std::cout << "Number of accepted models: " << accepted << std::endl;
+        if (interactive) {
+            std::cout << "[" << 100 << "%] " << std::string((unsigned long) (window.ws_col - 7), *"=") << "\r\n"
+                      << std::flush;
+            std::cout << "Number of accepted models: " << accepted << std::endl;
+        }
 
-        // Close output file
+        // Close output files
         samplesfile.close();
+        if (interactive) trajectoryfile.close();
+        if (costfile.is_open()) costfile.close();
+        return accepted;
     }
 
-    void linearSampler::leap_frog(bool writeTrajectory) {
+    void linearSampler::sample_tempering() {
+        run_tempering(_data, _currentModel, _outputSamples, true);
+    }
 
-        // start proposal at current momentum
-        _proposedModel = _currentModel;
+    unsigned long linearSampler::run_tempering(const quadraticData &data, vec &model, const char *outputSamples,
+                                               bool interactive) {
+        // Geometric temperature ladder from the chain temperature up to the hottest chain. The spacing is stored as
+        // the logarithm of the log-temperature gaps, so that adaptation keeps the ladder ordered.
+        auto chains = static_cast<long>(temperingChains);
+        std::vector<double> ladder((unsigned long) chains);
+        std::vector<double> logGaps((unsigned long) chains - 1, log(log(temperingMaximum / temperature) / (chains - 1)));
+        ladder[0] = temperature;
+        for (long k = 1; k < chains; k++) {
+            ladder[k] = ladder[k - 1] * exp(exp(logGaps[k - 1]));
+        }
 
-        arma::vec misfitGrad;
-        std::ofstream trajectoryfile;
+        // Every chain starts at the same model
+        std::vector<vec> models((unsigned long) chains, model);
+        std::vector<double> misfits((unsigned long) chains, misfit(data, model));
 
-        // Randomize settings as to ensure ergodicity
-        unsigned long local_nt = nt;
-        double local_dt = dt;
-        local_nt = static_cast<unsigned long>(nt * randf(0.5, 1.5));
-        local_dt = dt * randf(0.5, 1.5);
-
-        // Time integrate Hamiltons equations
-        for (int it = 0; it < local_nt; it++) {
-            misfitGrad = symmetricA ?
-                         arma::conv_to<vec>::from(2 * A * _proposedModel + B) :
-                         arma::conv_to<vec>::from(At * _proposedModel + A * _proposedModel + B);
-            _proposedMomentum = _proposedMomentum - 0.5 * local_dt * misfitGrad;
-            if (writeTrajectory) write_sample(trajectoryfile, chi());
-            _proposedModel = _proposedModel + local_dt *
-                                              (massMatrixType == 0 ?
-                                               conv_to<vec>::from(invMass * _proposedMomentum) :
-                                               conv_to<vec>::from(invMass % _proposedMomentum));
-            misfitGrad = symmetricA ?
-                         arma::conv_to<vec>::from(2 * A * _proposedModel + B) :
-                         arma::conv_to<vec>::from(At * _proposedModel + A * _proposedModel + B);
-            _proposedMomentum = _proposedMomentum - 0.5 * local_dt * misfitGrad;
-
-        }
-        if (writeTrajectory) trajectoryfile.close();
+        // Statistics per rung, swap statistics are stored at the lower of the two rungs
+        std::vector<unsigned long> accepted((unsigned long) chains, 0);
+        std::vector<unsigned long> swapsProposed((unsigned long) chains - 1, 0);
+        std::vector<unsigned long> swapsAccepted((unsigned long) chains - 1, 0);
+        std::vector<double> swapRate((unsigned long) chains - 1, 0.5);
+        unsigned long adaptationProposals = temperingAdapt ? proposals / 10 : 0;
+
+        // Open output file and write starting model. While the ladder adapts the chains are not Markov, their samples
+        // are not written.
+        std::ofstream samplesfile;
+        samplesfile.open(outputSamples);
+        if (adaptationProposals == 0) write_sample(samplesfile, models[0], misfits[0]);
+
+        // Write progress in percentages to console
+        if (interactive) std::cout << "[" << std::setw(3) << (int) (100.0 * double(0) / proposals) << "%] "
+                  << std::string(((unsigned long) ((window.ws_col - 7) * 0 / proposals)), *"=") <<
+                  "\r" << std::flush;
+
+        // Perform sampling
+        for (unsigned long it = 1; it < proposals; it++) {
+            // Write progress to console every 100 steps
+            if (interactive && it % 100 == 0) {
+                std::cout << "[" << std::setw(3) << (int) (100.0 * double(it) / proposals) << "%] "
+                          << std::string(((unsigned long) ((window.ws_col - 7) * it / proposals)), *"=") <<
+                          "\r" << std::flush;
+            }
+
+            // Propagate all chains independently
+            unsigned long coldAccepted = accepted[0];
+#pragma omp parallel for schedule(static)
+            for (long k = 0; k < chains; k++) {
+                if (hmc_transition(data, models[k], misfits[k], ladder[k], false)) accepted[k]++;
+            }
+            bool coldMoved = accepted[0] != coldAccepted;
+
+            // Propose swaps between neighbouring chains, alternating even and odd pairs
+            if (it % temperingSwapInterval == 0) {
+                for (long k = (it / temperingSwapInterval) % 2; k + 1 < chains; k += 2) {
+                    double exponent = (misfits[k] - misfits[k + 1]) * (1.0 / ladder[k] - 1.0 / ladder[k + 1]);
+                    double swapProbability = exponent >= 0 ? 1.0 : exp(exponent);
+                    swapsProposed[k]++;
+                    swapRate[k] += 0.1 * (swapProbability - swapRate[k]);
+                    if (swapProbability > randf(0.0, 1.0)) {
+                        swapsAccepted[k]++;
+                        std::swap(models[k], models[k + 1]);
+                        std::swap(misfits[k], misfits[k + 1]);
+                        if (k == 0) coldMoved = true;
+                    }
+                }
+
+                // Widen gaps with high swap acceptance and narrow gaps with low swap acceptance, at a decaying rate,
+                // keeping the coldest and hottest temperature fixed.
+                if (it < adaptationProposals) {
+                    double meanRate = 0;
+                    for (double rate : swapRate) meanRate += rate / (chains - 1);
+                    double gain = 1.0 / (1.0 + 10.0 * it / adaptationProposals);
+                    double sumGaps = 0;
+                    for (long k = 0; k + 1 < chains; k++) {
+                        logGaps[k] += gain * (swapRate[k] - meanRate);
+                        sumGaps += exp(logGaps[k]);
+                    }
+                    double normalization = log(log(temperingMaximum / temperature) / sumGaps);
+                    for (long k = 0; k + 1 < chains; k++) {
+                        logGaps[k] += normalization;
+                        ladder[k + 1] = ladder[k] * exp(exp(logGaps[k]));
+                    }
+                }
+            }
+
+            // The first state after adaptation starts the output, as the starting model does without adaptation
+            if (it >= adaptationProposals && (coldMoved || it == adaptationProposals)) {
+                write_sample(samplesfile, models[0], misfits[0]);
+            }
+        }
+
+        // Write out 100% at the end
+        if (interactive) {
+            std::cout << "[" << 100 << "%] " << std::string((unsigned long) (window.ws_col - 7), *"=") << "\r\n"
+                      << std::flush;
+        }
+
+        // Write out statistics per rung
+        if (interactive) std::cout << "Chain  temperature   acceptance   swap acceptance (with next)" << std::endl;
+        for (long k = 0; interactive && k < chains; k++) {
+            std::cout << std::setw(5) << k << "  " << std::setw(11) << ladder[k] << "  "
+                      << std::setw(11) << double(accepted[k]) / (proposals - 1);
+            if (k + 1 < chains) {
+                std::cout << "  " << std::setw(11) << (swapsProposed[k] == 0 ? 0.0 :
+                                                       double(swapsAccepted[k]) / swapsProposed[k]);
+            }
+            std::cout << std::endl;
+        }
+        if (interactive) std::cout << std::endl;
+
+        // Continue from the coldest chain
+        model = models[0];
+
+        // Close output file
+        samplesfile.close();
+        return accepted[0] + 1;
     }
 
-    void linearSampler::write_sample(std::ofstream &outfile, double misfit) {
-        for (double j : _proposedModel) {
+    void linearSampler::sample_batch() {
+        // Read the list of datasets, every line holds a B file, a C file and an output samples file
+        std::vector<std::string> B_files, C_files, outputFiles;
+        std::ifstream batch(batchFile);
+        if (!batch.is_open()) {
+            std::cerr << "Could not open batch file " << batchFile << "." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        std::string line;
+        while (std::getline(batch, line)) {
+            std::istringstream entries(line);
+            std::string B_entry, C_entry, output_entry;
+            if (entries >> B_entry >> C_entry >> output_entry) {
+                B_files.push_back(B_entry);
+                C_files.push_back(C_entry);
+                outputFiles.push_back(output_entry);
+            } else if (line.find_first_not_of(" \t\r") != std::string::npos) {
+                std::cerr << "Invalid line in batch file, skipping: " << line << std::endl;
+            }
+        }
+        auto datasets = static_cast<long>(B_files.size());
+        std::cout << "Sampling " << datasets << " datasets." << std::endl;
+
+        // The setup of A and the mass matrix is shared, datasets are sampled in parallel. Replica exchange is already
+        // parallel over chains, in that case the datasets are sampled one after another.
+        // A dataset that fails to load is reported and skipped, the other datasets are still sampled.
+        unsigned long finished = 0;
+        unsigned long skipped = 0;
+#pragma omp parallel for schedule(dynamic) if (temperingChains == 1)
+        for (long i = 0; i < datasets; i++) {
+            quadraticData batchData;
+            if (!load_data(B_files[i].c_str(), C_files[i].c_str(), batchData)) {
+#pragma omp critical
+                {
+                    finished++;
+                    skipped++;
+                    std::cout << "[" << finished << "/" << datasets << "] " << outputFiles[i]
+                              << ", skipped, dataset could not be loaded" << std::endl;
+                }
+                continue;
+            }
+            vec model = batchData.posteriorMode;
+            unsigned long accepted = (temperingChains > 1) ?
+                                     run_tempering(batchData, model, outputFiles[i].c_str(), false) :
+                                     run_chain(batchData, model, outputFiles[i].c_str(), false);
+#pragma omp critical
+            {
+                finished++;
+                std::cout << "[" << finished << "/" << datasets << "] " << outputFiles[i]
+                          << ", number of accepted models: " << accepted << std::endl;
+            }
+        }
+        if (skipped > 0) std::cerr << "Skipped " << skipped << " of " << datasets << " datasets." << std::endl;
+    }
+
+    void linearSampler::leap_frog(const quadraticData &data, vec &model, vec &momentum, vec &misfitGrad,
+                                  unsigned long steps, double timeStep, bool writeTrajectory, bool finalKick) {
+
+        // Time integrate Hamiltons equations, the gradient at the end of a step is reused at the start of the next
+        if (writeTrajectory) write_sample(trajectoryfile, model, 0.5 * dot(model, misfitGrad + data.B) + data.C);
+        for (unsigned long it = 0; it < steps; it++) {
+            momentum -= 0.5 * timeStep * misfitGrad;
+            model += timeStep * inverse_mass(momentum);
+            misfitGrad = gradient(data, model);
+            if (finalKick || it + 1 < steps) momentum -= 0.5 * timeStep * misfitGrad;
+            if (writeTrajectory) write_sample(trajectoryfile, model, 0.5 * dot(model, misfitGrad + data.B) + data.C);
+        }
+        if (writeTrajectory) trajectoryfile << std::endl;
+    }
+
+    void linearSampler::write_sample(std::ofstream &outfile, const vec &model, double misfit) {
+        for (double j : model) {
             outfile << std::setprecision(20) << j << "  ";
         }
         outfile << misfit;
@@ -269,13 +773,28 @@ namespace hmc {
         auto startWall = get_wall_time();
 
         // Allow for other methods, remnant of old structure
-        sample_neal();
+        if (strlen(batchFile) != 0) {
+            sample_batch();
+        } else if (temperingChains > 1) {
+            sample_tempering();
+        } else {
+            sample_neal();
+        }
+
+        if (algorithmNew && testBefore && !recycleTrajectory) {
+            std::cout << "Proposals whose acceptance was decided by the energy bound: " << decidedByBound
+                      << " (fully integrated, final kick and kinetic energy skipped)" << std::endl;
+        }
 
         // Output sampling time
         std::cout << "Sampling time CPU: " << (std::clock() - startCPU) / (double) (CLOCKS_PER_SEC)
                   << "s, wall: " << get_wall_time() - startWall << "s" << std::endl << std::endl;
     }
 
+    unsigned long linearSampler::gradient_evaluations() const {
+        return gradientEvaluations;
+    }
+
 
 } // namespace hmc
 
@@ -9,7 +9,9 @@
 #include <sys/ioctl.h>
 #include <cstdio>
 #include <unistd.h>
+#include <fstream>
 #include <armadillo>
+#include "convolutionOperator.hpp"
 
 using namespace arma;
 
@@ -24,11 +26,14 @@ namespace hmc {
         // Output files
         char *_outputSamplesFile = const_cast<char *>("OUTPUT/samples.txt");
         char *_outputTrajectoryFile = const_cast<char *>("OUTPUT/trajectory.txt");
+        char *_outputCostFile = const_cast<char *>(""); // Gradient evaluations and wall time per proposal, optional
 
         // ABC-style
         char *A_file = const_cast<char *>("");
+        char *A_kernel_file = const_cast<char *>(""); // Convolution operator replacing A, written by createQuadraticForm
         char *B_file = const_cast<char *>("");
         char *C_file = const_cast<char *>("");
+        char *_batchFile = const_cast<char *>(""); // List of B, C and output files sharing A, replaces -ib, -ic and -os
 
         // Tuning parameters
         double _timeStep = 0.1;
@@ -36,14 +41,24 @@ namespace hmc {
         unsigned long int _proposals = 1000;
         unsigned long int _trajectorySteps = 10;
         unsigned long int _massMatrixType = 0;
+        unsigned long int _massMatrixRank = 10; // Rank of the low rank plus diagonal mass matrix (type 3)
+
+        // Parallel tempering
+        unsigned long int _temperingChains = 1; // Number of rungs on the temperature ladder, 1 disables replica exchange.
+        unsigned long int _temperingSwapInterval = 1; // Proposals per rung between swap attempts.
+        double _temperingMaximum = 10.0; // Temperature of the hottest rung.
+        bool _temperingAdapt = true; // Adapt ladder spacing to equalize swap acceptance between neighbouring rungs.
 
         // Other options
         bool _algorithmNew = true;
         bool _genMomPropose = true; // Use generalized mass matrix to propose new momenta (true).
         bool _genMomKinetic = true; // Use generalized mass matrix to compute kinetic energy (true).
-        bool _testBefore = true; // Decreases required computation time by order of magnitude, no other influence.
+        bool _testBefore = true; // Decides acceptance by an energy bound where possible, skipping the final kick.
         bool _ergodic = true;  // Randomizes trajectory length and step size
         bool _adaptTimestep = true; // adapt timestep for mass-matrix choice
+        bool _recycleTrajectory = false; // Select the next state from all states of the trajectory (multinomial HMC)
+        unsigned long int _trajectoryInterval = 0; // Write every n-th trajectory, 0 writes only the last one
+        unsigned long int _seed = 0; // Seed of the random number generators, 0 seeds from the time
 
         // Parse command line options
         void parse_input(int argc, char *argv[]) {
@@ -62,21 +77,33 @@ namespace hmc {
                     if (strcmp(argv[i], "-ia") == 0 || strcmp(argv[i], "--inputA") == 0) {
                         A_file = (argv[i + 1]);
                         i++;
+                    } else if (strcmp(argv[i], "-iak") == 0 || strcmp(argv[i], "--inputAkernel") == 0) {
+                        A_kernel_file = (argv[i + 1]);
+                        i++;
                     } else if (strcmp(argv[i], "-ib") == 0 || strcmp(argv[i], "--inputB") == 0) {
                         B_file = (argv[i + 1]);
                         i++;
                     } else if (strcmp(argv[i], "-ic") == 0 || strcmp(argv[i], "--inputC") == 0) {
                         C_file = (argv[i + 1]);
                         i++;
+                    } else if (strcmp(argv[i], "-bf") == 0 || strcmp(argv[i], "--batchfile") == 0) {
+                        _batchFile = (argv[i + 1]);
+                        i++;
                     } else if (strcmp(argv[i], "-mtype") == 0 || strcmp(argv[i], "--massmatrixtype") == 0) {
                         parse_long_unsigned(argv, i, _massMatrixType);
                         i++;
+                    } else if (strcmp(argv[i], "-mrank") == 0 || strcmp(argv[i], "--massmatrixrank") == 0) {
+                        parse_long_unsigned(argv, i, _massMatrixRank);
+                        i++;
                     } else if (strcmp(argv[i], "-os") == 0 || strcmp(argv[i], "--outputsamples") == 0) {
                         _outputSamplesFile = (argv[i + 1]);
                         i++;
                     } else if (strcmp(argv[i], "-ot") == 0 || strcmp(argv[i], "--outputtrajectory") == 0) {
                         _outputTrajectoryFile = (argv[i + 1]);
                         i++;
+                    } else if (strcmp(argv[i], "-oc") == 0 || strcmp(argv[i], "--outputcost") == 0) {
+                        _outputCostFile = (argv[i + 1]);
+                        i++;
                     } else if (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--temperature") == 0) {
                         parse_double(argv, i, _temperature);
                         i++;
@@ -107,6 +134,27 @@ namespace hmc {
                     } else if (strcmp(argv[i], "-an") == 0 || strcmp(argv[i], "--algorithmnew") == 0) {
                         parse_boolean(argv, i, _algorithmNew);
                         i++;
+                    } else if (strcmp(argv[i], "-rt") == 0 || strcmp(argv[i], "--recycletrajectory") == 0) {
+                        parse_boolean(argv, i, _recycleTrajectory);
+                        i++;
+                    } else if (strcmp(argv[i], "-ti") == 0 || strcmp(argv[i], "--trajectoryinterval") == 0) {
+                        parse_long_unsigned(argv, i, _trajectoryInterval);
+                        i++;
+                    } else if (strcmp(argv[i], "-seed") == 0 || strcmp(argv[i], "--seed") == 0) {
+                        parse_long_unsigned(argv, i, _seed);
+                        i++;
+                    } else if (strcmp(argv[i], "-ptn") == 0 || strcmp(argv[i], "--temperingchains") == 0) {
+                        parse_long_unsigned(argv, i, _temperingChains);
+                        i++;
+                    } else if (strcmp(argv[i], "-ptmax") == 0 || strcmp(argv[i], "--temperingmaximum") == 0) {
+                        parse_double(argv, i, _temperingMaximum);
+                        i++;
+                    } else if (strcmp(argv[i], "-pts") == 0 || strcmp(argv[i], "--swapinterval") == 0) {
+                        parse_long_unsigned(argv, i, _temperingSwapInterval);
+                        i++;
+                    } else if (strcmp(argv[i], "-pta") == 0 || strcmp(argv[i], "--adaptladder") == 0) {
+                        parse_boolean(argv, i, _temperingAdapt);
+                        i++;
                     }
                 }
             }
@@ -157,7 +205,19 @@ namespace hmc {
                       << "\t\t \033[1;31m -os \033[0m (existing path to non-existing file, required)" << std::endl
                       << "\t\t output samples file" << std::endl
                       << "\t\t \033[1;31m -ot \033[0m (existing path to non-existing file, required)" << std::endl
-                      << "\t\t output trajectory file" << std::endl << std::endl
+                      << "\t\t output trajectory file, trajectories are separated by an empty line" << std::endl
+                      << "\t\t \033[1;32m -oc \033[0m (existing path to non-existing file, optional)" << std::endl
+                      << "\t\t output cost file, every proposal of a single chain adds a line with the number of \r\n\t\t "
+                         "gradient evaluations, the wall time and whether a new sample was written" << std::endl
+                      << "\t\t \033[1;32m -iak \033[0m (existing file, optional)" << std::endl
+                      << "\t\t convolution operator replacing A (see createQuadraticForm), products with A are \r\n\t\t "
+                         "computed by FFTs instead of the dense matrix" << std::endl
+                      << "\t\t \033[1;32m -bf \033[0m (existing file, optional)" << std::endl
+                      << "\t\t batch file, every line holds a B file, a C file and an output samples file; \r\n\t\t "
+                         "setup of A is done once and the datasets are sampled in parallel" << std::endl
+                      << "\t\t \033[1;32m -ti \033[0m (integer, default = 0)" << std::endl
+                      << "\t\t write the trajectory of every n-th proposal, 0 only writes the last one" << std::endl
+                      << std::endl
                       << "\tPrior information" << std::endl
                       << "\t\t \033[1;31m -means \033[0m (double, required)" << std::endl
                       << "\t\t Prior means" << std::endl
@@ -170,13 +230,18 @@ namespace hmc {
                       << "\t\t number of time discretization steps" << std::endl
                       << "\t\t \033[1;32m -t \033[0m (double, default = 1)" << std::endl
                       << "\t\t temperature" << std::endl
-                      << "\t\t \033[1;32m -mtype \033[0m (0, 1 or 2, default = 0)" << std::endl
-                      << "\t\t mass matrix type: full ideal (0), diagonal ideal (1) or unit matrix (2)"
-                      << std::endl
+                      << "\t\t \033[1;32m -mtype \033[0m (0, 1, 2 or 3, default = 0)" << std::endl
+                      << "\t\t mass matrix type: full ideal (0), diagonal ideal (1), unit matrix (2) or \r\n\t\t "
+                         "diagonal plus low rank approximation of the ideal matrix (3)" << std::endl
+                      << "\t\t \033[1;32m -mrank \033[0m (integer, default = 10)" << std::endl
+                      << "\t\t rank of the low rank part of mass matrix type 3" << std::endl
                       << std::endl
                       << "\tOther options" << std::endl
                       << "\t\t \033[1;32m -ns \033[0m (integer, default = 1000)" << std::endl
                       << "\t\t number of proposals" << std::endl
+                      << "\t\t \033[1;32m -seed \033[0m (integer, default = 0)" << std::endl
+                      << "\t\t seed of the random number generators for reproducible chains, 0 seeds from the time"
+                      << std::endl
                       << "\t\t \033[1;32m -at \033[0m (boolean, default = 1) " << std::endl
                       << "\t\t adapt timestep to be stable, using eigen-decomposition of the term sqrt(Q^-1 A)"
                       << std::endl
@@ -188,11 +253,27 @@ namespace hmc {
                       << "\t\t \033[1;32m -gmc\033[0m (boolean, default = 1)" << std::endl
                       << "\t\t use full mass matrix to calculate kinetic energy instead of diagonal" << std::endl
                       << "\t\t \033[1;32m -Hb\033[0m (boolean, default = 1)" << std::endl
-                      << "\t\t use conservation of energy to evaluate the Hamiltonian and acceptance \r\n\t\t     criterion "
-                         "before "
-                         "propagating, only for algorithm 1" << std::endl
+                      << "\t\t bound the final Hamiltonian by the energy conserved by leapfrog, only for algorithm 1; "
+                         "\r\n\t\t     proposals whose acceptance is decided by the bound are still fully integrated, "
+                         "\r\n\t\t     only their final momentum update and kinetic energy are skipped" << std::endl
                       << "\t\t \033[1;32m -an\033[0m (boolean, default = 1)" << std::endl
-                      << "\t\t choose HMC algorithm; classic (0), new (1)" << std::endl << std::endl
+                      << "\t\t choose HMC algorithm; classic (0), new (1), the new algorithm draws the acceptance \r\n\t\t     "
+                         "threshold before propagating" << std::endl
+                      << "\t\t \033[1;32m -rt\033[0m (boolean, default = 0)" << std::endl
+                      << "\t\t recycle trajectories; the next sample is drawn from all states of a trajectory \r\n\t\t     "
+                         "with weights exp(-H/T), the starting state being placed at a random position" << std::endl
+                      << std::endl
+                      << "\tParallel tempering" << std::endl
+                      << "\t\t \033[1;32m -ptn\033[0m (integer, default = 1)" << std::endl
+                      << "\t\t number of chains on the temperature ladder, run in parallel threads; only the \r\n\t\t "
+                         "coldest chain (temperature -t) is written to the samples file" << std::endl
+                      << "\t\t \033[1;32m -ptmax\033[0m (double, default = 10)" << std::endl
+                      << "\t\t temperature of the hottest chain" << std::endl
+                      << "\t\t \033[1;32m -pts\033[0m (integer, default = 1)" << std::endl
+                      << "\t\t number of proposals between swap attempts of neighbouring chains" << std::endl
+                      << "\t\t \033[1;32m -pta\033[0m (boolean, default = 1)" << std::endl
+                      << "\t\t adapt the (initially geometric) ladder spacing during the first 10% of proposals \r\n\t\t "
+                         "to equalize swap acceptance, samples are only written after adaptation" << std::endl << std::endl
                       << "\tFor examples, see inversions/" << std::endl << std::endl;
         }
 
@@ -210,6 +291,14 @@ namespace hmc {
         }
     };
 
+    // Data dependent part of the quadratic form. In batch mode several of these share A and the mass matrix.
+    struct quadraticData {
+        colvec B; ///< B in quadratic form.
+        double C = 0; ///< C in quadratic form.
+        vec posteriorMode; ///< Minimum of the quadratic form.
+        double minimumMisfit = 0; ///< Misfit at the minimum of the quadratic form.
+    };
+
     class linearSampler {
     public:
         /** \brief Constructor for a probabilistic sampler.
@@ -234,22 +323,45 @@ namespace hmc {
           * */
         void sample_neal();
 
+        /** \brief Method for sampling using replica exchange (parallel tempering). A ladder of chains at increasing
+          * temperature is propagated in parallel threads, and neighbouring chains periodically propose to swap their
+          * states. Only the coldest chain is written to the samples file, and only after the ladder adaptation.
+          * \return void
+          * */
+        void sample_tempering();
+
+        /** \brief Method for sampling a list of datasets (B and C) that share A. The setup of A and the mass matrix is
+          * done once, after which every dataset is sampled with its own output file, in parallel over datasets.
+          * \return void
+          * */
+        void sample_batch();
+
+        /** \brief Number of gradient evaluations of the misfit so far, a measure of the cost of sampling.
+          * \return Number of gradient evaluations.
+          * */
+        unsigned long gradient_evaluations() const;
+
     private:
         // States
         vec _currentModel; ///< State of markov chain describing coordinates of current point.
-        vec _proposedModel; ///< State of markov chain describing coordinates of proposal.
-        vec _proposedMomentum; ///< State of markov chain describing momentum of proposal.
 
         // Quadratic form
         mat A; ///< A in quadratic form.
         mat At; ///< A^t in quadratic form, speeds up proposals at the cost of memory.
         bool symmetricA = false; ///< boolean for symmetry of A in quadratic form, speeds up gradient calculations if true.
-        colvec B; ///< B in quadratic form.
-        double C; ///< C in quadratic form.
+        bool structuredA = false; ///< Whether A is given by a convolution operator instead of a dense matrix.
+        convolutionOperator convolution; ///< Convolution operator replacing A.
+        arma::uword parameters = 0; ///< Number of parameters of the quadratic form.
+        quadraticData _data; ///< B and C in quadratic form, for a single inversion.
+        mat modeOperator; ///< Maps B to the minimum of the quadratic form, for diagonal mass matrices.
 
         // Mass matrices
         mat massMatrix; ///< Mass matrix for HMC.
         mat invMass; ///< Inverse mass matrix for calculation of kinetic energy in HMC.
+        vec rootMassMatrix; ///< Square root of a diagonal mass matrix, standard deviations of the momenta.
+        mat massFactor; ///< Low rank factor F of the mass matrix D + F F^T (type 3).
+        mat woodburyFactor; ///< D^-1 F, for the inverse of the low rank mass matrix.
+        mat woodburyCore; ///< (I + F^T D^-1 F)^-1, for the inverse of the low rank mass matrix.
 
         // Settings
         unsigned long nt; ///< Number of time steps for trajectory in HMC.
@@ -257,40 +369,140 @@ namespace hmc {
         double temperature; ///< Temperature for acceptance criterion in MCMC.
         unsigned long proposals; ///< Number of proposals for MCMC.
         unsigned long massMatrixType; ///< Number of iterations in HMC.
+        unsigned long massMatrixRank; ///< Rank of the low rank part of the mass matrix (type 3).
         winsize window; ///< Size of terminal for nice output.
 
+        // Parallel tempering settings
+        unsigned long temperingChains; ///< Number of chains on the temperature ladder.
+        unsigned long temperingSwapInterval; ///< Number of proposals between swap attempts.
+        double temperingMaximum; ///< Temperature of the hottest chain.
+        bool temperingAdapt; ///< Whether to adapt the ladder spacing during the first part of sampling.
+
+        // Algorithm settings
+        bool algorithmNew; ///< Draw the acceptance threshold before propagating (new) or after (classic).
+        bool testBefore; ///< Use the energy bound to decide acceptance before the final kick, only for the new algorithm.
+        double maxFrequencySquared; ///< Largest eigenvalue of the inverse mass matrix times the Hessian of the misfit.
+        unsigned long decidedByBound = 0; ///< Number of proposals whose acceptance was decided by the energy bound.
+        unsigned long gradientEvaluations = 0; ///< Number of gradient evaluations of the misfit.
+        bool recycleTrajectory; ///< Select the next state from all states of the trajectory instead of the end point.
+        unsigned long trajectoryInterval; ///< Write the trajectory of every n-th proposal, 0 writes only the last one.
+        std::ofstream trajectoryfile; ///< Stream of trajectory output.
+
         // Pointers to files
         char *A_file; ///< Pointer to character array of filename containing A in the quadratic form.
+        char *A_kernel_file; ///< Pointer to character array of filename containing the convolution operator replacing A.
         char *B_file; ///< Pointer to character array of filename containing B in the quadratic form.
         char *C_file; ///< Pointer to character array of filename containing C in the quadratic form.
+        char *batchFile; ///< Pointer to character array of filename containing the list of datasets in batch mode.
         char *_outputSamples; ///< Pointer to character array of filename to store samples in MCMC.
         char *_outputTrajectory; ///< Pointer to character array of filename to store trajectory samples from HMC.
+        char *_outputCost; ///< Pointer to character array of filename to store the cost of every proposal.
 
         // Member methods
 
-        //
-        /** \brief Propose new momentum according to N(0,M), writes to \ref linearSampler::_proposedMomentum.
-          * \return void
+        /** \brief Load B and C of the quadratic form, and compute its minimum.
+          * \param B_path Filename containing B.
+          * \param C_path Filename containing C.
+          * \param data Data of the quadratic form, filled if loading succeeds.
+          * \return Whether B and C could be loaded and match the number of parameters.
+          * */
+        bool load_data(const char *B_path, const char *C_path, quadraticData &data);
+
+        /** \brief Sample a single chain, see sample_neal().
+          * \param data Data of the quadratic form.
+          * \param model Starting model, contains the final state of the chain afterwards.
+          * \param outputSamples Filename to write the samples to.
+          * \param interactive Whether to show progress and write trajectories.
+          * \return Number of accepted models.
+          * */
+        unsigned long run_chain(const quadraticData &data, vec &model, const char *outputSamples, bool interactive);
+
+        /** \brief Sample using replica exchange, see sample_tempering().
+          * \param data Data of the quadratic form.
+          * \param model Starting model, contains the final state of the coldest chain afterwards.
+          * \param outputSamples Filename to write the samples of the coldest chain to.
+          * \param interactive Whether to show progress and statistics per chain.
+          * \return Number of accepted models of the coldest chain.
           * */
-        void propose_momentum();
+        unsigned long run_tempering(const quadraticData &data, vec &model, const char *outputSamples, bool interactive);
 
-        // Integrate Hamilton's equations using a leapfrog scheme
-        void leap_frog(bool writeTrajectory);
+        /** \brief Propose new momentum according to N(0, T M).
+          * \param momentum Vector to write the momentum to.
+          * \param chainTemperature Temperature T of the chain the momentum is proposed for.
+          * \return void
+          * */
+        void propose_momentum(vec &momentum, double chainTemperature);
+
+        /** \brief Perform one HMC transition (momentum proposal, integration and acceptance test) of a chain.
+          * \param model State of the chain, overwritten by the proposal if it is accepted.
+          * \param modelMisfit Misfit of the state of the chain, updated if the proposal is accepted.
+          * \param chainTemperature Temperature of the chain.
+          * \param writeTrajectory Whether to write the trajectory to the trajectory file.
+          * \return Whether the proposal was accepted.
+          * */
+        bool hmc_transition(const quadraticData &data, vec &model, double &modelMisfit, double chainTemperature,
+                            bool writeTrajectory);
+
+        /** \brief Perform one multinomial HMC transition. The starting state is placed at a uniformly random position
+          * within a trajectory of fixed length, and the next state is selected from all states of the trajectory with
+          * probability proportional to exp(-H/T).
+          * \param model State of the chain, overwritten by the selected state.
+          * \param modelMisfit Misfit of the state of the chain, updated with the selected state.
+          * \param chainTemperature Temperature of the chain.
+          * \param writeTrajectory Whether to write the trajectory to the trajectory file.
+          * \return Whether a state other than the starting state was selected.
+          * */
+        bool multinomial_transition(const quadraticData &data, vec &model, double &modelMisfit, double chainTemperature,
+                                    bool writeTrajectory);
+
+        /** \brief Energy pre-test. Bounds the Hamiltonian at the end of the leapfrog trajectory using the shadow
+          * Hamiltonian it conserves, and checks whether the proposal is certain to be accepted.
+          * \param model Starting model of the trajectory.
+          * \param misfitGrad Gradient of the misfit at the starting model.
+          * \param hamiltonian Hamiltonian at the start of the trajectory.
+          * \param timeStep Time step of the trajectory.
+          * \param threshold Largest final Hamiltonian that is accepted.
+          * \return Whether the proposal is certain to be accepted.
+          * */
+        bool accept_before_propagation(const quadraticData &data, const vec &model, const vec &misfitGrad,
+                                       double hamiltonian, double timeStep, double threshold);
 
-        // Evaluate misfit (chi)
-        double chi();
+        // Integrate Hamilton's equations using a leapfrog scheme, misfitGrad is updated from the starting to the final model
+        void leap_frog(const quadraticData &data, vec &model, vec &momentum, vec &misfitGrad, unsigned long steps,
+                       double timeStep, bool writeTrajectory, bool finalKick);
 
-        // Evaluate Hamiltonian (H)
-        double energy();
+        // Evaluate gradient of the misfit
+        vec gradient(const quadraticData &data, const vec &model);
 
         // Write sample to one line of opened filestream
-        void write_sample(std::ofstream &outfile, double misfit);
+        void write_sample(std::ofstream &outfile, const vec &model, double misfit);
 
         // Calculate misfit of quadratic form
-        double misfit();
+        double misfit(const quadraticData &data, const vec &model);
 
         // Calculate kinetic energy as 1/2 pt M^-1 p
-        double kineticEnergy();
+        double kineticEnergy(const vec &momentum);
+
+        // Apply the inverse mass matrix, M^-1 p
+        vec inverse_mass(const vec &momentum);
+
+        // Apply the symmetric part of A
+        vec symmetric_product(const vec &model);
+
+        // Apply the symmetric part of A to every column
+        mat symmetric_product(const mat &models);
+
+        /** \brief Approximate the symmetric part of A by a diagonal plus a low rank matrix, using
+          * a randomized eigendecomposition. Sets up the factors for sampling momenta and applying the inverse.
+          * \return void
+          * */
+        void low_rank_mass();
+
+        /** \brief Find the minimum of the quadratic form by conjugate gradients, preconditioned by the mass matrix.
+          * \param B B in quadratic form.
+          * \return Minimum of the quadratic form.
+          * */
+        vec solve_mode(const colvec &B);
 
         arma::mat CholeskyLowerMassMatrix;
     };
@@ -4,7 +4,13 @@
 #include "randomnumbers.hpp"
 #include <cmath>
 #include <random>
+#include <cstdint>
+#include <atomic>
 #include <armadillo>
+#include <cblas.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 // todo rewrite using C++11 random functions.
 // Random number generators
@@ -26,43 +32,134 @@ double randn(double mean, double stdv) {
 
 }
 
-arma::vec randn(arma::vec means, arma::vec cov) {
-    return means + randn(std::move(cov));
-}
-
-arma::vec randn(arma::vec cov) {
-    // Zero mean
-    arma::vec samples(cov.size(), true);
-    for (int iStd = 0; iStd < cov.size(); ++iStd) {
-        samples[iStd] = (randn(0, sqrt(cov[iStd])));
+namespace {
+    // Seed set by randn_seed(), generators of every thread are reseeded when the epoch changes.
+    std::atomic<unsigned long> seedEpoch(0);
+    std::atomic<unsigned int> generatorSeed(0);
+
+    // Per-thread xoshiro256+ generator, seeded from rand() on first use unless randn_seed() was called.
+    struct uniformGenerator {
+        uint64_t state[4];
+
+        uniformGenerator() {
+            seed((uint64_t) rand() << 32 ^ (uint64_t) rand());
+        }
+
+        void seed(uint64_t value) {
+            // Splitmix64 expansion of the seed
+            for (uint64_t &s : state) {
+                value += 0x9e3779b97f4a7c15;
+                uint64_t z = value;
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+                s = z ^ (z >> 31);
+            }
+        }
+
+        // Uniform on (0, 1], so that the logarithm in the Box-Müller transform is finite.
+        double operator()() {
+            uint64_t result = state[0] + state[3];
+            uint64_t t = state[1] << 17;
+            state[2] ^= state[0];
+            state[3] ^= state[1];
+            state[1] ^= state[2];
+            state[0] ^= state[3];
+            state[2] ^= t;
+            state[3] = (state[3] << 45) | (state[3] >> 19);
+            return ((result >> 11) + 1) / 9007199254740992.0;
+        }
+    };
+
+    uniformGenerator &thread_generator() {
+        static thread_local uniformGenerator generator;
+        static thread_local unsigned long epoch = 0;
+        unsigned long currentEpoch = seedEpoch.load();
+        if (epoch != currentEpoch) {
+            // Every thread gets its own stream of the seed
+            uint64_t thread = 0;
+#ifdef _OPENMP
+            thread = (uint64_t) omp_get_thread_num();
+#endif
+            generator.seed((uint64_t) generatorSeed.load() << 32 ^ thread);
+            epoch = currentEpoch;
+        }
+        return generator;
     }
-    return samples;
 }
 
-arma::vec randn_Cholesky(arma::vec mean, arma::mat CholeskyLower_CovarianceMatrix) {
-    return mean + randn_Cholesky(std::move(CholeskyLower_CovarianceMatrix));
+void randn_seed(unsigned int seed) {
+    srand(seed);
+    generatorSeed = seed;
+    seedEpoch++;
 }
 
-arma::vec randn_Cholesky(arma::mat CholeskyLower_CovarianceMatrix) {
-    // Assumes zero mean
-    arma::vec uncorrelated(CholeskyLower_CovarianceMatrix.n_rows, true);
+void randn_fill(double *samples, arma::uword size) {
+    uniformGenerator &generator = thread_generator();
+
+    // Draw all uniforms first, so the transform below has no loop carried dependencies.
+    for (arma::uword i = 0; i < size; i++) {
+        samples[i] = generator();
+    }
 
-    for (int i = 0; i < CholeskyLower_CovarianceMatrix.n_rows; ++i) {
-        uncorrelated[i] = randn(0, 1);
+    // Box-Müller on pairs (z1[i], z2[i]), both outputs are used.
+    arma::uword half = size / 2;
+    double *z1 = samples;
+    double *z2 = samples + half;
+#pragma omp simd
+    for (arma::uword i = 0; i < half; i++) {
+        double radius = sqrt(-2.0 * log(z1[i]));
+        double angle = 2.0 * PI * z2[i];
+        z1[i] = radius * cos(angle);
+        z2[i] = radius * sin(angle);
     }
 
-    return CholeskyLower_CovarianceMatrix * uncorrelated;
+    // Odd number of samples
+    if (size % 2 == 1) {
+        samples[size - 1] = sqrt(-2.0 * log(samples[size - 1])) * cos(2.0 * PI * generator());
+    }
+}
 
+void randn_fill(const arma::vec &stdv, arma::vec &samples) {
+    samples.set_size(stdv.n_elem);
+    randn_fill(samples.memptr(), samples.n_elem);
+    samples %= stdv;
 }
 
-arma::vec randn(arma::mat DiagonalCovarianceMatrix) {
-    // Generate uncorrelated samples from diagonal.
-    arma::vec samples(DiagonalCovarianceMatrix.n_rows, true);
+void randn_Cholesky_fill(const arma::mat &CholeskyLower_CovarianceMatrix, arma::vec &samples) {
+    auto n = CholeskyLower_CovarianceMatrix.n_rows;
+    samples.set_size(n);
+    randn_fill(samples.memptr(), n);
 
-    for (int i = 0; i < DiagonalCovarianceMatrix.n_rows; i++) {
-        samples[i] = randn(0, sqrt(DiagonalCovarianceMatrix(i, i)));
-    }
+    // samples = L * samples, in place
+    cblas_dtrmv(CblasColMajor, CblasLower, CblasNoTrans, CblasNonUnit, (int) n,
+                CholeskyLower_CovarianceMatrix.memptr(), (int) n, samples.memptr(), 1);
+}
+
+arma::vec randn(const arma::vec &means, const arma::vec &cov) {
+    return means + randn(cov);
+}
+
+arma::vec randn(const arma::vec &cov) {
+    // Zero mean
+    arma::vec samples;
+    randn_fill(arma::vec(sqrt(cov)), samples);
     return samples;
 }
 
+arma::vec randn_Cholesky(const arma::vec &mean, const arma::mat &CholeskyLower_CovarianceMatrix) {
+    return mean + randn_Cholesky(CholeskyLower_CovarianceMatrix);
+}
+
+arma::vec randn_Cholesky(const arma::mat &CholeskyLower_CovarianceMatrix) {
+    // Assumes zero mean
+    arma::vec samples;
+    randn_Cholesky_fill(CholeskyLower_CovarianceMatrix, samples);
+    return samples;
+}
 
+arma::vec randn(const arma::mat &DiagonalCovarianceMatrix) {
+    // Generate uncorrelated samples from diagonal.
+    arma::vec samples;
+    randn_fill(arma::vec(sqrt(DiagonalCovarianceMatrix.diag())), samples);
+    return samples;
+}
@@ -8,6 +8,9 @@
  * This set of functions allows one to sample from mutliple types of normal distributions. All are based on a uniform
  * number generator which transforms to normally distributed samples using the Box-Müller transform.
  *
+ * The bulk functions (randn_fill, randn_Cholesky_fill) write into caller-provided buffers. They draw uniforms from a
+ * per-thread generator (seeded through rand(), or by randn_seed()) and apply the Box-Müller transform in a SIMD loop, using both outputs
+ * of every transform.
  */
 
 #ifndef HMC_VSP_RANDOMNUMBERS_HPP
@@ -27,22 +30,23 @@ const double PI = 3.14159265358979323846264338327;
 double randn(double mean, double stdv);
 
 /*!
- * @brief Draws from uncorrelated Gaussians \f$ \mathcal{N} (\boldsymbol \mu,\boldsymbol{\sigma}) \f$ (vectors of mean, standard deviation) using Box-Müller transform. Loops over both vectors and calls randn(double mean, double stdv) every
- * iteration.
+ * @brief Draws from uncorrelated Gaussians \f$ \mathcal{N} (\boldsymbol \mu,\boldsymbol{\sigma}) \f$ (vectors of mean,
+ * variance) using Box-Müller transform. Draws all samples at once through randn(const arma::vec &cov) and adds the
+ * means.
  * @param mean vector containing \f$ \mu_i \f$
- * @param cov vector containing \f$ \sigma_i \f$
+ * @param cov vector containing the variances \f$ \sigma_i^2 \f$
  * @return Vector of samples from the distributions.
  */
-arma::vec randn(arma::vec means, arma::vec cov);
+arma::vec randn(const arma::vec &means, const arma::vec &cov);
 
 /*!
  * @brief Draws zero-mean samples from uncorrelated Gaussians \f$ \mathcal{N} (\boldsymbol 0,\boldsymbol{\sigma}) \f$
- * (standard deviation) using Box-Müller transform. Loops over both vectors and calls randn(double mean, double stdv) every
- * iteration.
- * @param cov vector containing \f$ \sigma_i \f$
+ * (variance) using Box-Müller transform. Takes the square root of the variances and draws all samples at once with
+ * randn_fill(const arma::vec &stdv, arma::vec &samples).
+ * @param cov vector containing the variances \f$ \sigma_i^2 \f$
  * @return Vector of samples from the distributions.
  */
-arma::vec randn(arma::vec cov);
+arma::vec randn(const arma::vec &cov);
 
 /**
  * @brief Drawing non-zero mean samples from an \f$ n \f$ dimensional correlated Gaussian.
@@ -52,7 +56,7 @@ arma::vec randn(arma::vec cov);
  * of the n x n covariance matrix \f$ \boldsymbol \Sigma \f$, must be square and lower triangular.
  * @return Vector containing the non-zero mean correlated samples.
  */
-arma::vec randn_Cholesky(arma::vec mean, arma::mat CholeskyLower_CovarianceMatrix);
+arma::vec randn_Cholesky(const arma::vec &mean, const arma::mat &CholeskyLower_CovarianceMatrix);
 
 /**
  * @brief Drawing non-zero mean samples from an \f$ n \f$ dimensional correlated Gaussian. This algorithm uses the lower
@@ -62,14 +66,45 @@ arma::vec randn_Cholesky(arma::vec mean, arma::mat CholeskyLower_CovarianceMatri
  * of the n x n covariance matrix \f$ \boldsymbol \Sigma \f$, must be square and lower triangular.
  * @return Vector containing the zero mean correlated samples.
  */
-arma::vec randn_Cholesky(arma::mat CholeskyLower_CovarianceMatrix);
+arma::vec randn_Cholesky(const arma::mat &CholeskyLower_CovarianceMatrix);
 
 /**
  * @brief Drawing n zero mean samples from \f$ \mathcal{N} (\boldsymbol 0,\boldsymbol{\sigma}) \f$. No correlation is present between the parameters.
  * @param DiagonalCovarianceMatrix Matrix containing on the diagonal the variance, or standard deviation squared.
  * @return Vector containing n samples.
  */
-arma::vec randn(arma::mat DiagonalCovarianceMatrix);
+arma::vec randn(const arma::mat &DiagonalCovarianceMatrix);
+
+/**
+ * @brief Seeds rand() and the per-thread generators of the bulk functions, making the samples reproducible for a
+ * fixed seed and thread layout.
+ * @param seed Seed of the generators.
+ */
+void randn_seed(unsigned int seed);
+
+/**
+ * @brief Fills a buffer with samples from the standard normal distribution \f$ \mathcal{N} (0,1) \f$.
+ * @param samples Pointer to the buffer, should hold at least size doubles.
+ * @param size Number of samples to draw.
+ */
+void randn_fill(double *samples, arma::uword size);
+
+/**
+ * @brief Draws zero-mean samples from uncorrelated Gaussians \f$ \mathcal{N} (\boldsymbol 0,\boldsymbol{\sigma}) \f$
+ * into an existing vector, scaling standard normal samples by the standard deviations.
+ * @param stdv vector containing \f$ \sigma_i \f$
+ * @param samples Vector to write the samples to, resized to the size of stdv if necessary.
+ */
+void randn_fill(const arma::vec &stdv, arma::vec &samples);
+
+/**
+ * @brief Draws zero-mean samples from an \f$ n \f$ dimensional correlated Gaussian into an existing vector. Standard
+ * normal samples are transformed in place by the lower triangular Cholesky matrix using a single BLAS trmv call.
+ * @param CholeskyLower_CovarianceMatrix Matrix containing the n x n Lower Cholesky matrix
+ * of the n x n covariance matrix \f$ \boldsymbol \Sigma \f$, must be square and lower triangular.
+ * @param samples Vector to write the samples to, resized to n if necessary.
+ */
+void randn_Cholesky_fill(const arma::mat &CholeskyLower_CovarianceMatrix, arma::vec &samples);
 
 /**
  * @brief Draw uniformly distributed samples between two numbers.